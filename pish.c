@@ -17,15 +17,31 @@
 #define _GNU_SOURCE
 #include <argp.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <wait.h>
 
@@ -49,28 +65,52 @@ char *readline(const char *prompt) {
 
     buf = NULL;
   } else { // strip input line
-    while (strchr (" \t\v\n", *buf))
-      buf++;
+    char *s = buf;
 
-    char *end = buf + strlen (buf);
+    while (*s != '\0' && strchr(" \t\v\n", *s))
+      s++;
 
-    while (strchr (" \t\v\n", *end))
+    char *end = s + strlen(s);
+
+    while (end > s && strchr(" \t\v\n", end[-1]))
       end--;
 
-    end[1] = '\0';
+    *end = '\0';
+    memmove(buf, s, end - s + 1);
   }
 
-  return buf; // no need to clean up
+  return buf;
 }
 #endif /* WITH_GNU_READLINE */
 
+int pish_batch(char **argv, int fds[2]);
+int pish_break(char **argv, int fds[2]);
+int pish_cache(char **argv, int fds[2]);
+int pish_cat(char **argv, int fds[2]);
 int pish_chdir(char **argv, int fds[2]);
+int pish_continue(char **argv, int fds[2]);
+int pish_coproc(char **argv, int fds[2]);
+int pish_echo(char **argv, int fds[2]);
+int pish_enable(char **argv, int fds[2]);
 int pish_eval(char **argv, int fds[2]);
 int pish_exit(char **argv, int fds[2]);
+int pish_false(char **argv, int fds[2]);
+int pish_grep(char **argv, int fds[2]);
+int pish_head(char **argv, int fds[2]);
+int pish_true(char **argv, int fds[2]);
 int pish_help(char **argv, int fds[2]);
+int pish_history(char **argv, int fds[2]);
+int pish_mapfile(char **argv, int fds[2]);
+int pish_printf(char **argv, int fds[2]);
+int pish_read(char **argv, int fds[2]);
+int pish_return(char **argv, int fds[2]);
+int pish_sched(char **argv, int fds[2]);
 int pish_set(char **argv, int fds[2]);
+int pish_ulimit(char **argv, int fds[2]);
 int pish_unset(char **argv, int fds[2]);
 int pish_source(char **argv, int fds[2]);
+int pish_tee(char **argv, int fds[2]);
+int pish_wc(char **argv, int fds[2]);
 char *pish_fifo(const char *cmdline, const char *input);
 
 #define __unused __attribute__((unused))
@@ -82,52 +122,275 @@ struct pish_cmd_desc {
   char *cmdstr;
   int (*exec)(char **argv, int fds[2]);
   char **helpstr;
+  bool pure; /* touches no shell state, so it may run on a thread */
+  void *dl;  /* handle of the library a loaded builtin comes from */
 };
 
 static struct pish_cmd_desc pish_builtin_cmd[] = {
     {
-        "cd",
-        pish_chdir,
-        STRV("change directory."),
+        .cmdstr = "batch",
+        .exec = pish_batch,
+        .helpstr =
+            STRV("run a command in batches of arguments which fit in exec.",
+                 "/batch CMD ARGS/ splits ARGS after leading options of CMD.",
+                 "/batch -k N CMD ARGS/ repeats the first N ARGS in each "
+                 "batch.",
+                 "/batch -P N CMD ARGS/ runs N batches at once, 0 for one per "
+                 "cpu."),
+    },
+    {
+        .cmdstr = "break",
+        .exec = pish_break,
+        .helpstr =
+            STRV("leave enclosing loops.",
+                 "/break N/ leaves N levels of loops, default is 1."),
+    },
+    {
+        .cmdstr = "cache",
+        .exec = pish_cache,
+        .helpstr =
+            STRV("run a command once, and replay its output later.",
+                 "/cache [-t TTL] [-v NAME]... CMD ARGS/ keeps output of CMD "
+                 "for TTL",
+                 "(60s by default, with s, m, h or d), keyed by its words, "
+                 "working",
+                 "directory and variables NAME, only a run with status 0 is "
+                 "kept.",
+                 "/cache -c/ forgets all of them."),
+    },
+    {
+        .cmdstr = "cat",
+        .exec = pish_cat,
+        .helpstr =
+            STRV("concatenate files to output, - is input.",
+                 "data is moved by splice, copy_file_range or sendfile when "
+                 "it can,",
+                 "other options than -u run the external cat."),
+        .pure = true,
+    },
+    {
+        .cmdstr = "cd",
+        .exec = pish_chdir,
+        .helpstr = STRV("change directory."),
+    },
+    {
+        .cmdstr = "continue",
+        .exec = pish_continue,
+        .helpstr =
+            STRV("resume the next iteration of enclosing loops.",
+                 "/continue N/ resumes the N-th enclosing loop, default is 1."),
+    },
+    {
+        .cmdstr = "coproc",
+        .exec = pish_coproc,
+        .helpstr =
+            STRV("start a command with pipes in both directions.",
+                 "/coproc NAME CMD ARGS/ starts CMD, which reads from fd "
+                 "${NAME[1]}",
+                 "  and writes to fd ${NAME[0]}, its pid is in NAME_PID.",
+                 "/coproc -w NAME/ closes the pipes and waits for NAME."),
+    },
+    {
+        .cmdstr = "echo",
+        .exec = pish_echo,
+        .helpstr =
+            STRV("print arguments, separated by spaces.",
+                 "/echo -n ARGS/ prints no newline after them."),
+        .pure = true,
+    },
+    {
+        .cmdstr = "enable",
+        .exec = pish_enable,
+        .helpstr =
+            STRV("load builtin commands from a shared library.",
+                 "/enable/ lists builtin commands.",
+                 "/enable -f LIB NAME.../ loads function NAME from LIB as a "
+                 "builtin,",
+                 "  it is int NAME(char **argv, int fds[2]), and its help "
+                 "may be",
+                 "  given by a NULL ended char *NAME_help[].",
+                 "/enable -d NAME/ unloads builtin NAME."),
+    },
+    {
+        .cmdstr = "eval",
+        .exec = pish_eval,
+        .helpstr =
+            STRV("evaluate expression.",
+                 "/eval ARG.../ joins ARGs by spaces and runs them as a line "
+                 "of script,",
+                 "a repeated one is not parsed again."),
+    },
+    {
+        .cmdstr = "exit",
+        .exec = pish_exit,
+        .helpstr = STRV("exit pish."),
+    },
+    {
+        .cmdstr = "false",
+        .exec = pish_false,
+        .helpstr = STRV("do nothing, unsuccessfully."),
+    },
+    {
+        .cmdstr = "grep",
+        .exec = pish_grep,
+        .helpstr =
+            STRV("print lines containing a fixed string.",
+                 "/grep [-F] [-v] [-c] [-q] [-e PAT]... [PAT] [FILE]/,",
+                 "a pattern with regex characters, or other options, runs the "
+                 "external grep."),
+        .pure = true,
+    },
+    {
+        .cmdstr = "head",
+        .exec = pish_head,
+        .helpstr =
+            STRV("print first lines of input.",
+                 "/head [-n N] [-c N] [FILE]/, it stops reading once done, and "
+                 "seeks a",
+                 "regular file back to the end of what it prints."),
+        .pure = true,
+    },
+    {
+        .cmdstr = "help",
+        .exec = pish_help,
+        .helpstr = STRV("show help about builtin commands."),
+        .pure = true,
+    },
+    {
+        .cmdstr = "history",
+        .exec = pish_history,
+        .helpstr =
+            STRV("list or search history of interactive shells, kept in "
+                 "$HISTFILE,",
+                 "default is ~/.pish_history, and shared by all of them.",
+                 "/history [N]/ lists last N entries, or all of them.",
+                 "/history -s PAT [N]/ lists last N entries containing PAT, "
+                 "newest first,",
+                 "  which are looked up by a trigram index in $HISTFILE.idx.",
+                 "/history -r/ rebuilds the index, which is otherwise rebuilt "
+                 "when",
+                 "  an interactive shell leaves, once the log has grown by "
+                 "1MB."),
     },
     {
-        "eval",
-        pish_eval,
-        STRV("evaluate expression."),
+        .cmdstr = "mapfile",
+        .exec = pish_mapfile,
+        .helpstr =
+            STRV("read lines from input into an array.",
+                 "/mapfile A/ stores lines in array A, default is MAPFILE.",
+                 "/mapfile -t A/ strips newlines from lines.",
+                 "/mapfile -n N A/ reads at most N lines."),
     },
     {
-        "exit",
-        pish_exit,
-        STRV("exit pish."),
+        .cmdstr = "printf",
+        .exec = pish_printf,
+        .helpstr =
+            STRV("print arguments by a format.",
+                 "/printf FMT ARGS/ supports %s %b %c %d %i %u %o %x %X and "
+                 "%%,",
+                 "  with flags, width and precision, FMT is reused while there "
+                 "are ARGS."),
+        .pure = true,
     },
     {
-        "help",
-        pish_help,
-        STRV("show help about builtin commands."),
+        .cmdstr = "read",
+        .exec = pish_read,
+        .helpstr =
+            STRV("read a line from input, split it into variables.",
+                 "/read A B/ sets A to the first word, B to the rest.",
+                 "/read/ sets REPLY to the whole line."),
     },
     {
-        "set",
-        pish_set,
-        STRV("manipulating environment variables.",
-             "/set/ displays all keys and values in environ.",
-             "/set A/ sets the value of A to \"\".",
-             "/set A B/ sets the value of A to B."),
+        .cmdstr = "return",
+        .exec = pish_return,
+        .helpstr =
+            STRV("return from a function.",
+                 "/return N/ returns with status N, default is status of the "
+                 "last command."),
     },
     {
-        "unset",
-        pish_unset,
-        STRV("unset an environment variable", "/unset A/ unsets variable A."),
+        .cmdstr = "sched",
+        .exec = pish_sched,
+        .helpstr =
+            STRV("run a command with scheduling attributes.",
+                 "/sched [--cpus LIST] [--nice N] [--ionice CLASS[:N]] "
+                 "[--policy P] [--prio N] CMD/",
+                 "LIST is like 0-3,8, CLASS is idle, be or rt, P is other, "
+                 "batch, idle,",
+                 "fifo or rr. they are set in the child before exec, so a "
+                 "pipeline stage",
+                 "costs no extra process, a builtin or function runs in a "
+                 "subshell."),
     },
     {
-        "source",
-        pish_source,
-        STRV("read & execute contents of a file, line by line."),
+        .cmdstr = "set",
+        .exec = pish_set,
+        .helpstr =
+            STRV("manipulating environment variables.",
+                 "/set/ displays all keys and values in environ.",
+                 "/set A/ sets the value of A to \"\".",
+                 "/set A B/ sets the value of A to B.",
+                 "/set -o OPT/ turns on option OPT, /set +o OPT/ turns it off.",
+                 "/set -o/ lists options, which are:",
+                 "  autosplit: run commands too long for exec in batches.",
+                 "  flowstat: report fill of pipes and CPU of pipeline "
+                 "stages."),
+    },
+    {
+        .cmdstr = "ulimit",
+        .exec = pish_ulimit,
+        .helpstr =
+            STRV("get or set resource limits.",
+                 "/ulimit [-H] [-S] [-a] [-cdflmnstuv [N|unlimited]]... [-- "
+                 "CMD]/,",
+                 "sizes are in KiB, -t in seconds. without CMD they are "
+                 "limits of the shell,",
+                 "with CMD they are set only in its child before exec, a "
+                 "function CMD",
+                 "limits a whole pipeline, in a subshell."),
+    },
+    {
+        .cmdstr = "unset",
+        .exec = pish_unset,
+        .helpstr =
+            STRV("unset an environment variable",
+                 "/unset A/ unsets variable A.",
+                 "/unset -f F/ unsets function F."),
+    },
+    {
+        .cmdstr = "source",
+        .exec = pish_source,
+        .helpstr = STRV("read & execute contents of a file, line by line."),
+    },
+    {
+        .cmdstr = "tee",
+        .exec = pish_tee,
+        .helpstr =
+            STRV("copy input to output and files.",
+                 "/tee -a FILES/ appends to FILES.",
+                 "data is duplicated by tee and splice between pipes and a "
+                 "file,",
+                 "other options than -a and -i run the external tee."),
+        .pure = true,
+    },
+    {
+        .cmdstr = "true",
+        .exec = pish_true,
+        .helpstr = STRV("do nothing, successfully."),
+    },
+    {
+        .cmdstr = "wc",
+        .exec = pish_wc,
+        .helpstr =
+            STRV("count lines or bytes.", "/wc -l [FILE]/ or /wc -c [FILE]/, "
+                                          "others run the external wc."),
+        .pure = true,
     },
 };
 
 static int pish_argc;
 static char **pish_argv;
-static char pish_status[6] = {'0', '\0'};
+static char pish_status[12] = {'0', '\0'};
 
 /** substring */
 char *strsub(const char *s, int len) {
@@ -265,25 +528,414 @@ char *sv_unfold(char **sv, const char *sep, const char *head,
     len += (seplen + strlen(sv[i]));
 
   char *s = malloc(len * sizeof(char));
+  char *e = stpcpy(s, head ?: ""); /* end of s, not to scan it again */
 
-  if (head)
-    strcpy(s, head);
-  else
-    s[0] = '\0';
-
-  strcat(s, sv[0]);
+  e = stpcpy(e, sv[0]);
 
   for (int i = 1; sv[i] != NULL; i++) {
-    strcat(s, sep);
-    strcat(s, sv[i]);
+    e = stpcpy(e, sep);
+    e = stpcpy(e, sv[i]);
   }
 
   if (tail)
-    strcat(s, tail);
+    stpcpy(e, tail);
 
   return s;
 }
 
+/**
+ * append @s to string vector @sv holding @*n strings with room for @*max,
+ * extend it if needed, the vector is kept ended with NULL.
+ * return the (possibly moved) vector.
+ */
+char **sv_push(char **sv, int *n, int *max, char *s) {
+  if (!sv || *n + 1 >= *max) /* extend vector */
+  {
+    *max = *max > 1 ? *max * 2 : 4;
+    sv = realloc(sv, sizeof(char *) * *max);
+  }
+
+  sv[(*n)++] = s;
+  sv[*n] = NULL;
+  return sv;
+}
+
+/** entry of a hash table */
+struct ht_ent {
+  char *key;
+  void *val;
+  struct ht_ent *next;
+};
+
+/** a chained hash table keyed by strings, zero initialized is empty */
+struct ht {
+  size_t cap; /* number of buckets, a power of 2 */
+  size_t cnt; /* number of entries */
+  struct ht_ent **bkt;
+};
+
+/** FNV-1a hash of string @s */
+static size_t ht_hash(const char *s) {
+  size_t h = 14695981039346656037ULL;
+
+  while (*s)
+    h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+
+  return h;
+}
+
+/** find the link pointing at entry @key, or at the end of its bucket */
+static struct ht_ent **ht_link(struct ht *t, const char *key) {
+  struct ht_ent **pe = &t->bkt[ht_hash(key) & (t->cap - 1)];
+
+  while (*pe && strcmp((*pe)->key, key) != 0)
+    pe = &(*pe)->next;
+
+  return pe;
+}
+
+/** get value of @key, NULL if not found */
+void *ht_get(struct ht *t, const char *key) {
+  if (!t->cnt)
+    return NULL;
+
+  struct ht_ent *e = *ht_link(t, key);
+
+  return e ? e->val : NULL;
+}
+
+/**
+ * set value of @key to @val,
+ * return the value it replaces, or NULL if it is a new key.
+ */
+void *ht_put(struct ht *t, const char *key, void *val) {
+  if (t->cnt >= t->cap) { /* rehash into twice as many buckets */
+    size_t cap = t->cap ? t->cap * 2 : 16;
+    struct ht_ent **bkt = calloc(cap, sizeof(struct ht_ent *));
+
+    for (size_t i = 0; i < t->cap; i++) {
+      struct ht_ent *e = t->bkt[i];
+
+      while (e) {
+        struct ht_ent *next = e->next;
+        size_t h = ht_hash(e->key) & (cap - 1);
+
+        e->next = bkt[h];
+        bkt[h] = e;
+        e = next;
+      }
+    }
+
+    free(t->bkt);
+    t->bkt = bkt;
+    t->cap = cap;
+  }
+
+  struct ht_ent **pe = ht_link(t, key);
+
+  if (*pe) {
+    void *old = (*pe)->val;
+
+    (*pe)->val = val;
+    return old;
+  }
+
+  *pe = calloc(1, sizeof(struct ht_ent));
+  (*pe)->key = strclo(key);
+  (*pe)->val = val;
+  t->cnt++;
+  return NULL;
+}
+
+/** remove @key, return its value, or NULL if not found */
+void *ht_del(struct ht *t, const char *key) {
+  if (!t->cnt)
+    return NULL;
+
+  struct ht_ent **pe = ht_link(t, key);
+  struct ht_ent *e = *pe;
+
+  if (!e)
+    return NULL;
+
+  void *val = e->val;
+
+  *pe = e->next;
+  free(e->key);
+  free(e);
+  t->cnt--;
+  return val;
+}
+
+/* function bodies by name */
+static struct ht pish_funcs;
+
+/* builtins loaded by enable -f, by name */
+static struct ht pish_loaded;
+
+/** an indexed array variable */
+struct pish_array {
+  int n;    /* number of elements */
+  int max;  /* room of @v */
+  char **v; /* elements, ended with NULL */
+};
+
+/* array variables by name */
+static struct ht pish_arrays;
+
+void pish_array_free(struct pish_array *a) {
+  if (a) {
+    sv_free(a->v);
+    free(a);
+  }
+}
+
+/** make @name an empty array, dropping its old elements */
+struct pish_array *pish_array_new(const char *name) {
+  struct pish_array *a = calloc(1, sizeof(struct pish_array));
+
+  a->v = sv_push(NULL, &a->n, &a->max, NULL);
+  a->n = 0;
+  pish_array_free(ht_put(&pish_arrays, name, a));
+  return a;
+}
+
+/** append @s to array @a, it takes @s */
+static inline void pish_array_push(struct pish_array *a, char *s) {
+  a->v = sv_push(a->v, &a->n, &a->max, s);
+}
+
+/*
+ * channels between builtin stages of a pipeline running in the shell,
+ * a single-producer single-consumer ring, given to builtins as a pair
+ * of virtual fds, which pish_xread()/pish_xwrite() take like real ones.
+ * a side sleeps on a futex only when the ring is empty or full.
+ */
+#define PISH_CHAN_SIZE (64 * 1024) /* a power of 2 */
+#define PISH_CHAN_MAX 256
+#define PISH_VFD (1 << 24) /* read end is PISH_VFD + 2 * slot, write end + 1 */
+
+struct pish_rbuf;
+static void pish_rbuf_free(struct pish_rbuf *rb);
+
+struct pish_chan {
+  _Atomic unsigned head; /* bytes written */
+  _Atomic unsigned tail; /* bytes read */
+  _Atomic unsigned rev;  /* futex of reader, bumped to wake it */
+  _Atomic unsigned wev;  /* futex of writer */
+  atomic_bool rwait;
+  atomic_bool wwait;
+  atomic_bool rclosed;
+  atomic_bool wclosed;
+  atomic_int refs;
+  struct pish_rbuf *rb; /* read-ahead buffer of line oriented readers */
+  char buf[PISH_CHAN_SIZE];
+};
+
+static _Atomic(struct pish_chan *) pish_chans[PISH_CHAN_MAX];
+
+/* set on threads running pipeline stages, which leave shell state alone */
+static __thread bool pish_in_task;
+
+static inline bool pish_isvfd(int fd) { return fd >= PISH_VFD; }
+
+static inline struct pish_chan *pish_chan(int fd) {
+  return pish_chans[(fd - PISH_VFD) / 2];
+}
+
+/** open a channel, store its read and write ends in @fds */
+static bool pish_chan_open(int fds[2]) {
+  struct pish_chan *c = calloc(1, sizeof(struct pish_chan));
+
+  c->refs = 2;
+
+  for (int i = 0; i < PISH_CHAN_MAX; i++) {
+    struct pish_chan *null = NULL;
+
+    if (atomic_compare_exchange_strong(&pish_chans[i], &null, c)) {
+      fds[0] = PISH_VFD + 2 * i;
+      fds[1] = fds[0] + 1;
+      return true;
+    }
+  }
+
+  free(c);
+  return false;
+}
+
+/** wake the other side sleeping on @ev, if @wait says it sleeps */
+static void pish_chan_wake(_Atomic unsigned *ev, atomic_bool *wait) {
+  if (*wait) {
+    (*ev)++;
+    syscall(SYS_futex, ev, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+/** sleep on @ev, unless @pos moves away from @val or @closed is set */
+static void pish_chan_wait(_Atomic unsigned *ev, atomic_bool *wait,
+                           _Atomic unsigned *pos, unsigned val,
+                           atomic_bool *closed) {
+  unsigned e = *ev;
+
+  *wait = true;
+
+  if (*pos == val && !*closed)
+    syscall(SYS_futex, ev, FUTEX_WAIT_PRIVATE, e, NULL, NULL, 0);
+
+  *wait = false;
+}
+
+static ssize_t pish_chan_write(struct pish_chan *c, const char *s,
+                               size_t len) {
+  size_t done = 0;
+
+  while (done < len) {
+    unsigned h = c->head;
+    unsigned t = c->tail;
+    size_t n = PISH_CHAN_SIZE - (h - t);
+
+    if (c->rclosed) {
+      errno = EPIPE;
+      return -1;
+    }
+
+    if (n == 0) {
+      pish_chan_wait(&c->wev, &c->wwait, &c->tail, t, &c->rclosed);
+      continue;
+    }
+
+    size_t off = h & (PISH_CHAN_SIZE - 1);
+    size_t run = PISH_CHAN_SIZE - off;
+
+    if (n > len - done)
+      n = len - done;
+
+    if (run > n)
+      run = n;
+
+    memcpy(c->buf + off, s + done, run);
+    memcpy(c->buf, s + done + run, n - run);
+    c->head = h + n;
+    done += n;
+    pish_chan_wake(&c->rev, &c->rwait);
+  }
+
+  return len;
+}
+
+static ssize_t pish_chan_read(struct pish_chan *c, char *s, size_t len) {
+  for (;;) {
+    unsigned t = c->tail;
+    unsigned h = c->head;
+    size_t n = h - t;
+
+    if (n == 0) {
+      if (c->wclosed && c->head == t)
+        return 0;
+
+      pish_chan_wait(&c->rev, &c->rwait, &c->head, h, &c->wclosed);
+      continue;
+    }
+
+    size_t off = t & (PISH_CHAN_SIZE - 1);
+    size_t run = PISH_CHAN_SIZE - off;
+
+    if (n > len)
+      n = len;
+
+    if (run > n)
+      run = n;
+
+    memcpy(s, c->buf + off, run);
+    memcpy(s + run, c->buf, n - run);
+    c->tail = t + n;
+    pish_chan_wake(&c->wev, &c->wwait);
+    return n;
+  }
+}
+
+/** write all of @buf to @fd, which may be a channel */
+ssize_t pish_xwrite(int fd, const void *buf, size_t len) {
+  if (pish_isvfd(fd))
+    return pish_chan_write(pish_chan(fd), buf, len);
+
+  for (size_t done = 0; done < len;) {
+    ssize_t n = write(fd, (const char *)buf + done, len - done);
+
+    if (n < 0 && errno != EINTR)
+      return -1;
+
+    if (n > 0)
+      done += n;
+  }
+
+  return len;
+}
+
+/** read from @fd, which may be a channel */
+ssize_t pish_xread(int fd, void *buf, size_t len) {
+  if (pish_isvfd(fd))
+    return pish_chan_read(pish_chan(fd), buf, len);
+
+  return read(fd, buf, len);
+}
+
+/** dprintf() to @fd, which may be a channel */
+int pish_xprintf(int fd, const char *fmt, ...) {
+  va_list ap;
+  char *s;
+  int len;
+
+  va_start(ap, fmt);
+
+  if (!pish_isvfd(fd)) {
+    len = vdprintf(fd, fmt, ap);
+    va_end(ap);
+    return len;
+  }
+
+  len = vasprintf(&s, fmt, ap);
+  va_end(ap);
+
+  if (len >= 0 && pish_xwrite(fd, s, len) < 0)
+    len = -1;
+
+  free(s);
+  return len;
+}
+
+/** drop a reference to the channel of @fd, it is freed by the last one */
+static void pish_chan_unref(int fd) {
+  int slot = (fd - PISH_VFD) / 2;
+  struct pish_chan *c = pish_chans[slot];
+
+  if (--c->refs == 0) {
+    pish_rbuf_free(c->rb);
+    pish_chans[slot] = NULL;
+    free(c);
+  }
+}
+
+/** close @fd, which may be an end of a channel */
+void pish_xclose(int fd) {
+  if (!pish_isvfd(fd)) {
+    close(fd);
+    return;
+  }
+
+  struct pish_chan *c = pish_chan(fd);
+
+  if (fd & 1) {
+    c->wclosed = true;
+    pish_chan_wake(&c->rev, &c->rwait);
+  } else {
+    c->rclosed = true;
+    pish_chan_wake(&c->wev, &c->wwait);
+  }
+
+  pish_chan_unref(fd);
+}
+
 /** test if an character represents an oct digit */
 static inline int isodigit(int __c) { return ('0' <= __c) && (__c <= '7'); }
 
@@ -321,31 +973,40 @@ const char *eseqtoch(char **pb, const char **pp, const char *end, bool quote) {
     *(*pb)++ = *p++;
     break;
   case 'a':
-    *(*pb)++ = quote ? *p++ : '\a';
+    *(*pb)++ = quote ? *p : '\a';
+    p++;
     break;
   case 'b':
-    *(*pb)++ = quote ? *p++ : '\b';
+    *(*pb)++ = quote ? *p : '\b';
+    p++;
     break;
   case 'e':
-    *(*pb)++ = quote ? *p++ : '\033';
+    *(*pb)++ = quote ? *p : '\033';
+    p++;
     break;
   case 'f':
-    *(*pb)++ = quote ? *p++ : '\f';
+    *(*pb)++ = quote ? *p : '\f';
+    p++;
     break;
   case 'n':
-    *(*pb)++ = quote ? *p++ : '\n';
+    *(*pb)++ = quote ? *p : '\n';
+    p++;
     break;
   case 'r':
-    *(*pb)++ = quote ? *p++ : '\r';
+    *(*pb)++ = quote ? *p : '\r';
+    p++;
     break;
   case 't':
-    *(*pb)++ = quote ? *p++ : '\t';
+    *(*pb)++ = quote ? *p : '\t';
+    p++;
     break;
   case 'v':
-    *(*pb)++ = quote ? *p++ : '\v';
+    *(*pb)++ = quote ? *p : '\v';
+    p++;
     break;
   case 'z':
-    *(*pb)++ = quote ? *p++ : EOF;
+    *(*pb)++ = quote ? *p : EOF;
+    p++;
     break;
   case 'x':
     if (p + 2 < end) {
@@ -534,417 +1195,6255 @@ out:
   return argv;
 }
 
-int pish_chdir(char **argv, int fds[2]) {
-  close(fds[0]);
+/** characters separating words on a command line */
+#define PISH_IFS " \t\v\n"
+/** characters that end a word outside of quotes */
+#define PISH_META PISH_IFS ";|()"
+
+/** parse errors */
+#define PISH_ESYNTAX (-1) /* malformed input */
+#define PISH_EMORE (-2)   /* input ends inside a construct */
+
+/** tokens of the command language */
+enum pish_tok {
+  PISH_T_EOF,
+  PISH_T_WORD,
+  PISH_T_NL,    /* '\n' */
+  PISH_T_SEMI,  /* ';' */
+  PISH_T_DSEMI, /* ";;" */
+  PISH_T_PIPE,  /* '|' */
+  PISH_T_LPAR,  /* '(' */
+  PISH_T_RPAR,  /* ')' */
+  PISH_T_FAN,   /* "|>" */
+  PISH_T_AND,   /* "&&" */
+  PISH_T_OR,    /* "||" */
+};
 
-  if (argv[1])
-    return chdir(argv[1]);
-  else
-    return -1;
-}
+/**
+ * a word as it is written, with its quotes.
+ * words without anything to expand are split only once, when parsed,
+ * and the resulting fields are cached in @fv.
+ */
+struct pish_word {
+  char *raw;
+  char **fv;
+  char *splice;             /* array spliced by ${A[@]}, "@" for $@ */
+  struct pish_brace *brace; /* brace expansion of raw, if any */
+  bool glob;                /* has glob characters out of quotes */
+};
 
-int pish_help(__unused char **argv, int fds[2]) {
-  close(fds[0]);
+enum pish_node_type {
+  PISH_PIPE,  /* pipeline, stages in @kid, branches fed by it in @alt */
+  PISH_CMD,   /* simple command, argv in @wv */
+  PISH_IF,    /* if @kid then @body else @alt */
+  PISH_WHILE, /* while @kid do @body */
+  PISH_UNTIL, /* until @kid do @body */
+  PISH_FOR,   /* for @name in @wv do @body */
+  PISH_CASE,  /* case @wv[0] in @body */
+  PISH_ITEM,  /* case item, patterns in @wv, list in @body */
+  PISH_GROUP, /* { @kid }, in the shell unless it has to stream */
+  PISH_SUBSHELL, /* ( @kid ), always in a forked child */
+  PISH_FUNC,  /* @name () @body */
+  PISH_ASSIGN, /* @name=@wv[0], or @name=(@wv) if @list */
+  PISH_REDIR,  /* redirection, operator in @name, target in @wv[0] */
+  PISH_AND,    /* @kid && @body */
+  PISH_OR,     /* @kid || @body */
+};
+
+/**
+ * node of a parsed command, nodes in the same list are chained on @next.
+ * a command is parsed once, and then it can be run many times.
+ * a node may be shared, e.g. by a function table, @refs counts
+ * references besides the one from its parent.
+ */
+struct pish_node {
+  enum pish_node_type type;
+  int refs;
+  bool bang; /* negated pipeline */
+  bool list; /* array assignment */
+  int wc;    /* number of words, -1 for a for loop without "in" */
+  struct pish_word *wv;
+  char *name;
+  struct pish_node *kid;
+  struct pish_node *body;
+  struct pish_node *alt;
+  struct pish_node *redir; /* redirections of a pipeline stage */
+  struct pish_node *next;
+};
 
-  for (size_t i = 0; i < ARRAY_SIZE(pish_builtin_cmd); ++i) {
-    dprintf(fds[1], "%s:\n", pish_builtin_cmd[i].cmdstr);
+/** state of a recursive descent parser with one token lookahead */
+struct pish_parser {
+  const char *p;     /* next character to read */
+  enum pish_tok tok; /* lookahead token */
+  char *word;        /* text of lookahead word */
+  int err;           /* 0, PISH_ESYNTAX or PISH_EMORE */
+};
 
-    char **s = pish_builtin_cmd[i].helpstr;
+/** reserved words which close a list */
+static const char *pish_closers[] = {"then", "elif", "else", "fi", "do",
+                                     "done", "esac", "}",    NULL};
 
-    while (*s)
-      dprintf(fds[1], "\t%s\n", *s++);
+/**
+ * skip a string literal or a $(...), ${...} substitution started at @p,
+ * return position after it, or NULL if input ends before it is closed.
+ */
+static const char *pish_skip_quote(const char *p) {
+  if (*p == '"') {
+    for (p++; *p != '"'; p++) {
+      if (*p == '\0' || (*p == '\\' && *++p == '\0'))
+        return NULL;
+    }
+    return p + 1;
   }
 
-  return 0;
-}
+  int lch = p[1];
+  int rch = (lch == '(') ? ')' : '}';
+  int depth = 0;
 
-int pish_exit(char **argv, __unused int fds[2]) {
-  if (argv[1])
-    exit(strtol(argv[1], NULL, 10)); // exit with given value
-  else
-    exit(0);
+  for (p++; *p != '\0'; p++) {
+    if (*p == '"') {
+      if (!(p = pish_skip_quote(p)))
+        return NULL;
+      p--;
+    } else if (*p == lch)
+      depth++;
+    else if (*p == rch && --depth == 0)
+      return p + 1;
+  }
+
+  return NULL;
 }
 
 /**
- * expand all substrings started with '$' in string @s.
- * supports recursive $(...) subshell and nonrecursive ${...} subkey.
- * return a new string, do not forget to free it!
+ * if @s of @len characters is "name=" or "name[index]=",
+ * return length of name, otherwise return 0.
  */
-char *pish_expand(const char *s) {
-  char **v = sv_fold(s, "$");
-  int n = sv_len(v);
-  int k = (s[0] == '$') ? 0 : 1; /* expand the first token? */
+static int pish_assign_name(const char *s, int len) {
+  int i = 0;
 
-  for (int i = k; i < n; ++i) {
-    char *end = NULL;
-    char *key = NULL;
-    char *val = NULL;
+  if (len < 2 || s[len - 1] != '=' || !(isalpha(*s) || *s == '_'))
+    return 0;
 
-    if (v[i][0] == '(') {
-      if (strchp(v[i], '(', ')') == 0) /* balanced ? */
-      {
-        end = strrchr(v[i], ')');
-        char *cmd = strsub(&v[i][1], end - &v[i][1]);
-        val = pish_fifo(cmd, NULL);
+  while (isalnum(s[i]) || s[i] == '_')
+    i++;
 
-        free(cmd);
-      } else if (i + 1 < n) /* unbalanced, defer it to subshell */
-      {
-        /*
-         * transform:      fold           unfold
-         *  $ ( S $ ( S ) ) => ( S | ( S ) ) => | ( S $ ( S ) )
-         */
-        val = sv_unfold((char *[]){v[i], v[i + 1], NULL},
-                        (v[i + 1][0] == '(' ? "$" : NULL), "", "");
-        free(v[i]);
-        v[i] = strclo("");
-        free(v[i + 1]); // just replace
-        v[i + 1] = val;
-        continue;
-      } else
-        goto out;
-    } else {
-      if (v[i][0] == '{' && (end = strchr(v[i], '}')))
-        key = strsub(&v[i][1], end - &v[i][1]);
-      else
-        key = strclo(v[i]);
+  if (i == len - 1 || (s[i] == '[' && s[len - 2] == ']'))
+    return i;
 
-      if (*key == '?')
-        val = strclo(pish_status);
-      else if (isdigit(*key)) {
-        int m = c2oct(*key);
-        if (m < pish_argc)
-          val = strclo(pish_argv[m]);
+  return 0;
+}
+
+/** read next token into lookahead */
+static void pish_lex(struct pish_parser *ps) {
+  const char *p = ps->p;
+
+  free(ps->word);
+  ps->word = NULL;
+
+  while (*p == ' ' || *p == '\t' || *p == '\v')
+    p++;
+
+  if (*p == '#') // comments
+    while (*p != '\0' && *p != '\n')
+      p++;
+
+  switch (*p) {
+  case '\0':
+    ps->tok = PISH_T_EOF;
+    break;
+  case '\n':
+    ps->tok = PISH_T_NL;
+    p++;
+    break;
+  case ';':
+    ps->tok = (p[1] == ';') ? PISH_T_DSEMI : PISH_T_SEMI;
+    p += (p[1] == ';') ? 2 : 1;
+    break;
+  case '|':
+    ps->tok = (p[1] == '|')   ? PISH_T_OR
+              : (p[1] == '>') ? PISH_T_FAN
+                              : PISH_T_PIPE;
+    p += (p[1] == '|' || p[1] == '>') ? 2 : 1;
+    break;
+  case '&':
+    if (p[1] != '&')
+      goto word;
+
+    ps->tok = PISH_T_AND;
+    p += 2;
+    break;
+  case '(':
+    ps->tok = PISH_T_LPAR;
+    p++;
+    break;
+  case ')':
+    ps->tok = PISH_T_RPAR;
+    p++;
+    break;
+  default:
+  word: {
+    const char *s = p;
+
+    while (*p != '\0' && !strchr(PISH_META, *p) &&
+           !(*p == '&' && p[1] == '&')) {
+      if (*p == '"' || (*p == '$' && (p[1] == '(' || p[1] == '{'))) {
+        const char *q = pish_skip_quote(p);
+
+        if (!q) { /* unclosed, wait for more lines */
+          ps->err = PISH_EMORE;
+          ps->tok = PISH_T_EOF;
+          ps->p = p + strlen(p);
+          return;
+        }
+        p = q;
       } else
-        val = strclo(getenv(key) ?: "");
+        p++;
+    }
+
+    /* name=(...) takes an array literal as a part of word */
+    if (*p == '(' && pish_assign_name(s, p - s) && p[-2] != ']') {
+      const char *q = p + 1;
+
+      while (q && *q != ')') {
+        if (*q == '\0')
+          q = NULL;
+        else if (*q == '"' || (*q == '$' && (q[1] == '(' || q[1] == '{')))
+          q = pish_skip_quote(q);
+        else
+          q++;
+      }
+
+      if (!q) {
+        ps->err = PISH_EMORE;
+        ps->tok = PISH_T_EOF;
+        ps->p = p + strlen(p);
+        return;
+      }
+
+      p = q + 1;
+    }
+
+    ps->word = strsub(s, p - s);
+    ps->tok = PISH_T_WORD;
+  }
+  }
+
+  ps->p = p;
+}
+
+/** mark a syntax error at lookahead, unless an error is already there */
+static void pish_syntax_error(struct pish_parser *ps) {
+  if (!ps->err)
+    ps->err = (ps->tok == PISH_T_EOF) ? PISH_EMORE : PISH_ESYNTAX;
+}
+
+/** test if lookahead is reserved word @kw */
+static bool pish_kw(struct pish_parser *ps, const char *kw) {
+  return ps->tok == PISH_T_WORD && strcmp(ps->word, kw) == 0;
+}
+
+/** consume lookahead if it is reserved word @kw */
+static bool pish_accept(struct pish_parser *ps, const char *kw) {
+  if (!pish_kw(ps, kw))
+    return false;
+
+  pish_lex(ps);
+  return true;
+}
+
+/** consume reserved word @kw, or mark a syntax error */
+static bool pish_expect(struct pish_parser *ps, const char *kw) {
+  if (pish_accept(ps, kw))
+    return true;
+
+  pish_syntax_error(ps);
+  return false;
+}
+
+/** skip newlines */
+static void pish_linebreak(struct pish_parser *ps) {
+  while (ps->tok == PISH_T_NL)
+    pish_lex(ps);
+}
+
+/** test if lookahead is a reserved word which closes a list */
+static bool pish_closing(struct pish_parser *ps) {
+  for (const char **kw = pish_closers; *kw; kw++)
+    if (pish_kw(ps, *kw))
+      return true;
+
+  return false;
+}
+
+/*
+ * brace expansion is compiled by parser into a list of segments,
+ * a word expands to the cartesian product of its segment values.
+ */
+enum pish_bseg_type {
+  PISH_B_LIT, /* literal text, one value */
+  PISH_B_ALT, /* {a,b,c}, values are expanded alternatives */
+  PISH_B_SEQ, /* {x..y[..step]}, values are generated on demand */
+};
+
+struct pish_bseg {
+  enum pish_bseg_type type;
+  int n;         /* number of values */
+  int len;       /* max length of a value */
+  char **v;      /* values of PISH_B_LIT and PISH_B_ALT */
+  long lo, step; /* values of PISH_B_SEQ are lo, lo + step, ... */
+  int width;     /* zero padded width of numbers */
+  bool alpha;    /* sequence of letters */
+};
+
+struct pish_brace {
+  int n;
+  struct pish_bseg *segs;
+  long count; /* number of words */
+  int len;    /* max length of a word */
+};
+
+/* limit of words a brace expansion may generate */
+#define PISH_BRACE_MAX (1L << 24)
+
+/** skip a quote or substitution at @p, without passing @end */
+static const char *pish_brace_skip(const char *p, const char *end) {
+  if (*p == '"' || (*p == '$' && (p[1] == '(' || p[1] == '{'))) {
+    p = pish_skip_quote(p);
+    return (p && p <= end) ? p : end;
+  }
+
+  return p + 1;
+}
+
+/**
+ * find '}' matching '{' at @p before @end,
+ * count commas at its top level into @commas.
+ */
+static const char *pish_brace_close(const char *p, const char *end,
+                                    int *commas) {
+  int depth = 0;
+
+  *commas = 0;
+
+  while (p < end) {
+    if (*p == '{')
+      depth++;
+    else if (*p == '}' && --depth == 0)
+      return p;
+    else if (*p == ',' && depth == 1)
+      (*commas)++;
+
+    p = pish_brace_skip(p, end);
+  }
+
+  return NULL;
+}
+
+void pish_brace_free(struct pish_brace *b) {
+  if (!b)
+    return;
+
+  for (int i = 0; i < b->n; i++)
+    sv_free(b->segs[i].v);
+
+  free(b->segs);
+  free(b);
+}
+
+/** append segment @sg to @b, return false if too many words */
+static bool pish_brace_add(struct pish_brace *b, struct pish_bseg *sg) {
+  if (sg->n == 0 || b->count * sg->n > PISH_BRACE_MAX) {
+    sv_free(sg->v);
+    return false;
+  }
+
+  b->segs = realloc(b->segs, (b->n + 1) * sizeof(struct pish_bseg));
+  b->segs[b->n++] = *sg;
+  b->count *= sg->n;
+  b->len += sg->len;
+  return true;
+}
+
+/** append literal [@s, @end) to @b */
+static void pish_brace_lit(struct pish_brace *b, const char *s,
+                           const char *end) {
+  struct pish_bseg sg = {.type = PISH_B_LIT, .n = 1, .len = end - s};
+
+  if (end == s)
+    return;
+
+  sg.v = calloc(2, sizeof(char *));
+  sg.v[0] = strsub(s, end - s);
+  pish_brace_add(b, &sg);
+}
+
+/** write value @i of @sg into @buf, return its length */
+static int pish_bseg_put(struct pish_bseg *sg, int i, char *buf) {
+  long v = sg->lo + i * sg->step;
+
+  if (sg->type != PISH_B_SEQ) {
+    int len = strlen(sg->v[i]);
+
+    memcpy(buf, sg->v[i], len);
+    return len;
+  }
+
+  if (sg->alpha) {
+    *buf = v;
+    return 1;
+  }
+
+  return sprintf(buf, "%0*ld", sg->width, v);
+}
+
+/** generate words of @b into @out, in order of the rightmost fastest */
+static void pish_brace_gen(struct pish_brace *b, char **out) {
+  int *idx = calloc(b->n + 1, sizeof(int));
+  char *buf = malloc(b->len + 1);
+
+  for (long k = 0; k < b->count; k++) {
+    int len = 0;
+
+    for (int j = 0; j < b->n; j++)
+      len += pish_bseg_put(&b->segs[j], idx[j], buf + len);
+
+    out[k] = strsub(buf, len);
+
+    for (int j = b->n - 1; j >= 0 && ++idx[j] == b->segs[j].n; j--)
+      idx[j] = 0;
+  }
+
+  free(buf);
+  free(idx);
+}
+
+/** parse sequence x..y[..step] in [@s, @end) into @sg */
+static bool pish_brace_seq(struct pish_bseg *sg, const char *s,
+                           const char *end) {
+  char *q = strsub(s, end - s);
+  char *lo = q;
+  char *hi = strstr(q, "..");
+  char *step = hi ? strstr(hi + 2, "..") : NULL;
+  char *e;
+  long x, y, z = 1;
+  bool ok = false;
+
+  if (!hi)
+    goto out;
+
+  *hi = '\0';
+  hi += 2;
+
+  if (step) {
+    *step = '\0';
+    step += 2;
+    z = strtol(step, &e, 10);
+
+    if (!*step || *e)
+      goto out;
+  }
+
+  if (isalpha(lo[0]) && !lo[1] && isalpha(hi[0]) && !hi[1]) {
+    x = lo[0];
+    y = hi[0];
+    sg->alpha = true;
+  } else {
+    x = strtol(lo, &e, 10);
+
+    if (!*lo || *e)
+      goto out;
+
+    y = strtol(hi, &e, 10);
+
+    if (!*hi || *e)
+      goto out;
+
+    /* a leading zero pads all numbers to the widest end */
+    if ((lo[lo[0] == '-'] == '0' && strlen(lo) > 1) ||
+        (hi[hi[0] == '-'] == '0' && strlen(hi) > 1))
+      sg->width = (strlen(lo) > strlen(hi)) ? strlen(lo) : strlen(hi);
+  }
+
+  z = labs(z ?: 1);
+  sg->type = PISH_B_SEQ;
+  sg->lo = x;
+  sg->step = (x <= y) ? z : -z;
+
+  if (labs(y - x) / z >= PISH_BRACE_MAX)
+    goto out;
+
+  sg->n = labs(y - x) / z + 1;
+  sg->len = 21 + sg->width;
+  ok = true;
+out:
+  free(q);
+  return ok;
+}
+
+static struct pish_brace *pish_brace_parse(const char *s, const char *end);
+
+/** parse alternatives a,b,c in [@s, @end) into @sg */
+static bool pish_brace_alt(struct pish_bseg *sg, const char *s,
+                           const char *end) {
+  int depth = 0;
+
+  sg->type = PISH_B_ALT;
+  sg->v = calloc(1, sizeof(char *));
+
+  for (const char *a = s, *p = s; p <= end;) {
+    if (p < end && *p != ',') {
+      depth += (*p == '{') - (*p == '}');
+      p = pish_brace_skip(p, end);
+      continue;
+    }
+
+    if (p < end && depth > 0) {
+      p++;
+      continue;
+    }
+
+    struct pish_brace *b = pish_brace_parse(a, p);
+
+    if (sg->n + b->count > PISH_BRACE_MAX) {
+      pish_brace_free(b);
+      sv_free(sg->v);
+      return false;
+    }
+
+    sg->v = realloc(sg->v, (sg->n + b->count + 1) * sizeof(char *));
+    pish_brace_gen(b, &sg->v[sg->n]);
+    sg->n += b->count;
+    sg->v[sg->n] = NULL;
+
+    if (b->len > sg->len)
+      sg->len = b->len;
+
+    pish_brace_free(b);
+    a = ++p;
+  }
+
+  return true;
+}
+
+/** parse brace expansions in [@s, @end), quotes and substitutions aside */
+static struct pish_brace *pish_brace_parse(const char *s, const char *end) {
+  struct pish_brace *b = calloc(1, sizeof(struct pish_brace));
+  const char *lit = s;
+
+  b->count = 1;
+
+  for (const char *p = s; p < end;) {
+    struct pish_bseg sg = {0};
+    int commas;
+    const char *q;
+
+    if (*p != '{') {
+      p = pish_brace_skip(p, end);
+      continue;
+    }
+
+    q = pish_brace_close(p, end, &commas);
+
+    if (!q || !(commas ? pish_brace_alt(&sg, p + 1, q)
+                       : pish_brace_seq(&sg, p + 1, q))) {
+      p++;
+      continue;
+    }
+
+    pish_brace_lit(b, lit, p);
+
+    if (!pish_brace_add(b, &sg)) {
+      lit = p++;
+      continue;
+    }
+
+    p = lit = q + 1;
+  }
+
+  pish_brace_lit(b, lit, end);
+  return b;
+}
+
+/** compile brace expansion of word @s, NULL if it has none */
+static struct pish_brace *pish_brace_compile(const char *s) {
+  struct pish_brace *b;
+
+  if (!strchr(s, '{') || !strpbrk(s, ",."))
+    return NULL;
+
+  b = pish_brace_parse(s, s + strlen(s));
+
+  for (int i = 0; i < b->n; i++)
+    if (b->segs[i].type != PISH_B_LIT)
+      return b;
+
+  pish_brace_free(b);
+  return NULL;
+}
+
+/**
+ * append word @raw to @n, taking it.
+ * a word that is only ${A[@]} or $@, quoted or not, is compiled into
+ * a splice of the array, so that its elements are never joined or split.
+ */
+static void pish_add_word(struct pish_node *n, char *raw) {
+  struct pish_word *w;
+  int len = strlen(raw);
+  const char *s = raw;
+
+  n->wv = realloc(n->wv, (n->wc + 1) * sizeof(struct pish_word));
+  w = &n->wv[n->wc++];
+  w->raw = raw;
+  w->fv = strchr(raw, '$') ? NULL : pish_fold(raw, PISH_IFS, false);
+  w->splice = NULL;
+  w->brace = pish_brace_compile(raw);
+  w->glob = false;
+
+  if (w->brace) {
+    sv_free(w->fv);
+    w->fv = NULL;
+  }
+
+  /* look for glob characters out of quotes and substitutions */
+  for (const char *p = raw; p && *p;) {
+    if (*p == '"' || (*p == '$' && (p[1] == '(' || p[1] == '{')))
+      p = pish_skip_quote(p);
+    else if (strchr("*?[", *p++))
+      w->glob = true;
+  }
+
+  if (len > 2 && s[0] == '"' && s[len - 1] == '"') {
+    s++;
+    len -= 2;
+  }
+
+  if ((len == 2 && strncmp(s, "$@", 2) == 0) ||
+      (len == 4 && strncmp(s, "${@}", 4) == 0))
+    w->splice = strclo("@");
+  else if (len > 6 && strncmp(s, "${", 2) == 0 && !strchr("#!", s[2]) &&
+           strncmp(&s[len - 4], "[@]}", 4) == 0 &&
+           strcspn(s + 2, "[") == (size_t)(len - 6))
+    w->splice = strsub(s + 2, len - 6);
+}
+
+/** append the lookahead word to @n, taking its text */
+static void pish_push_word(struct pish_node *n, struct pish_parser *ps) {
+  pish_add_word(n, ps->word);
+  ps->word = NULL;
+  pish_lex(ps);
+}
+
+static struct pish_node *pish_node_new(enum pish_node_type type) {
+  struct pish_node *n = calloc(1, sizeof(struct pish_node));
+
+  n->type = type;
+  return n;
+}
+
+/** free a list of nodes, a shared node only drops a reference */
+void pish_node_free(struct pish_node *n) {
+  while (n) {
+    struct pish_node *next = n->next;
+
+    if (n->refs > 0) {
+      n->refs--;
+      return; /* a shared node is never in a list */
+    }
+
+    for (int i = 0; i < n->wc; i++) {
+      free(n->wv[i].raw);
+      free(n->wv[i].splice);
+      sv_free(n->wv[i].fv);
+      pish_brace_free(n->wv[i].brace);
+    }
+
+    free(n->wv);
+    free(n->name);
+    pish_node_free(n->kid);
+    pish_node_free(n->body);
+    pish_node_free(n->alt);
+    pish_node_free(n->redir);
+    free(n);
+    n = next;
+  }
+}
+
+/**
+ * split lookahead name=value or name=(value...) word into an assignment,
+ * elements of an array literal are parsed here once.
+ */
+static struct pish_node *pish_parse_assign(struct pish_parser *ps) {
+  struct pish_node *n = pish_node_new(PISH_ASSIGN);
+  char *eq = strchr(ps->word, '=');
+  int len = strlen(eq + 1);
+
+  n->name = strsub(ps->word, eq - ps->word);
+
+  if (eq[1] == '(' && eq[len] == ')') {
+    char *lit = strsub(eq + 2, len - 2);
+    struct pish_parser sub = {.p = lit};
+
+    n->list = true;
+
+    for (pish_lex(&sub); sub.tok != PISH_T_EOF; pish_lex(&sub)) {
+      if (sub.tok == PISH_T_WORD) {
+        pish_add_word(n, sub.word);
+        sub.word = NULL;
+      } else if (sub.tok != PISH_T_NL) {
+        ps->err = PISH_ESYNTAX;
+        break;
+      }
+    }
+
+    free(sub.word);
+    free(lit);
+  } else
+    pish_add_word(n, strclo(eq + 1));
+
+  pish_lex(ps);
+  return n;
+}
+
+static struct pish_node *pish_parse_list(struct pish_parser *ps);
+static struct pish_node *pish_parse_pipeline(struct pish_parser *ps);
+
+/** a list which must not be empty */
+static struct pish_node *pish_parse_body(struct pish_parser *ps) {
+  struct pish_node *n = pish_parse_list(ps);
+
+  if (!n)
+    pish_syntax_error(ps);
+
+  return n;
+}
+
+/**
+ * if list then list { elif list then list } [ else list ] fi
+ * elif is parsed as a nested if, which consumes the only fi.
+ */
+static struct pish_node *pish_parse_if(struct pish_parser *ps) {
+  struct pish_node *n = pish_node_new(PISH_IF);
+
+  pish_lex(ps); /* if or elif */
+
+  if (!(n->kid = pish_parse_body(ps)) || !pish_expect(ps, "then") ||
+      !(n->body = pish_parse_body(ps)))
+    return n;
+
+  if (pish_kw(ps, "elif"))
+    n->alt = pish_parse_if(ps);
+  else {
+    if (pish_accept(ps, "else"))
+      n->alt = pish_parse_body(ps);
+
+    pish_expect(ps, "fi");
+  }
+
+  return n;
+}
+
+/** while|until list do list done */
+static struct pish_node *pish_parse_while(struct pish_parser *ps) {
+  struct pish_node *n =
+      pish_node_new(pish_kw(ps, "while") ? PISH_WHILE : PISH_UNTIL);
+
+  pish_lex(ps);
+
+  if ((n->kid = pish_parse_body(ps)) && pish_expect(ps, "do") &&
+      (n->body = pish_parse_body(ps)))
+    pish_expect(ps, "done");
+
+  return n;
+}
+
+/** for name [ in word... ] ; do list done */
+static struct pish_node *pish_parse_for(struct pish_parser *ps) {
+  struct pish_node *n = pish_node_new(PISH_FOR);
+
+  pish_lex(ps);
+
+  if (ps->tok != PISH_T_WORD) {
+    pish_syntax_error(ps);
+    return n;
+  }
+
+  n->name = ps->word;
+  ps->word = NULL;
+  pish_lex(ps);
+  pish_linebreak(ps);
+
+  if (pish_accept(ps, "in")) {
+    while (ps->tok == PISH_T_WORD)
+      pish_push_word(n, ps);
+  } else
+    n->wc = -1;
+
+  if (ps->tok == PISH_T_SEMI)
+    pish_lex(ps);
+
+  pish_linebreak(ps);
+
+  if (pish_expect(ps, "do") && (n->body = pish_parse_body(ps)))
+    pish_expect(ps, "done");
+
+  return n;
+}
+
+/** case word in { [(] pattern { | pattern } ) list ;; } esac */
+static struct pish_node *pish_parse_case(struct pish_parser *ps) {
+  struct pish_node *n = pish_node_new(PISH_CASE);
+  struct pish_node **tail = &n->body;
+
+  pish_lex(ps);
+
+  if (ps->tok != PISH_T_WORD) {
+    pish_syntax_error(ps);
+    return n;
+  }
+
+  pish_push_word(n, ps);
+  pish_linebreak(ps);
+
+  if (!pish_expect(ps, "in"))
+    return n;
+
+  pish_linebreak(ps);
+
+  while (!ps->err && !pish_accept(ps, "esac")) {
+    struct pish_node *item = pish_node_new(PISH_ITEM);
+
+    *tail = item;
+    tail = &item->next;
+
+    if (ps->tok == PISH_T_LPAR)
+      pish_lex(ps);
+
+    do {
+      if (ps->tok != PISH_T_WORD) {
+        pish_syntax_error(ps);
+        return n;
+      }
+
+      pish_push_word(item, ps);
+    } while (ps->tok == PISH_T_PIPE && (pish_lex(ps), true));
+
+    if (ps->tok != PISH_T_RPAR) {
+      pish_syntax_error(ps);
+      return n;
+    }
+
+    pish_lex(ps);
+    item->body = pish_parse_list(ps);
+
+    if (ps->tok == PISH_T_DSEMI) {
+      pish_lex(ps);
+      pish_linebreak(ps);
+    } else if (!pish_kw(ps, "esac"))
+      pish_syntax_error(ps);
+  }
+
+  return n;
+}
+
+/** { list } */
+static struct pish_node *pish_parse_group(struct pish_parser *ps) {
+  struct pish_node *n = pish_node_new(PISH_GROUP);
+
+  pish_lex(ps);
+
+  if ((n->kid = pish_parse_body(ps)))
+    pish_expect(ps, "}");
+
+  return n;
+}
+
+static struct pish_node *pish_parse_command(struct pish_parser *ps);
+
+/**
+ * name () compound-command
+ * @n is the simple command holding name, turned into a definition.
+ */
+static struct pish_node *pish_parse_func(struct pish_parser *ps,
+                                         struct pish_node *n) {
+  pish_lex(ps);
+
+  if (ps->tok != PISH_T_RPAR) {
+    pish_syntax_error(ps);
+    return n;
+  }
+
+  pish_lex(ps);
+  pish_linebreak(ps);
+
+  n->type = PISH_FUNC;
+  n->name = strclo(n->wv[0].raw);
+
+  if ((n->body = pish_parse_command(ps)) && n->body->type == PISH_CMD &&
+      !ps->err)
+    ps->err = PISH_ESYNTAX; /* body must be compound */
+
+  return n;
+}
+
+/** length of the redirection operator @w starts with, 0 if none */
+static int pish_redir_op(const char *w) {
+  if (strncmp(w, ">>", 2) == 0 || strncmp(w, ">&", 2) == 0 ||
+      strncmp(w, "<&", 2) == 0)
+    return 2;
+
+  return (*w == '<' || *w == '>') ? 1 : 0;
+}
+
+/**
+ * op target, or optarget in one word.
+ * append the redirection to @n, return false on a syntax error.
+ */
+static bool pish_parse_redir(struct pish_parser *ps, struct pish_node *n) {
+  struct pish_node *r = pish_node_new(PISH_REDIR);
+  struct pish_node **tail = &n->redir;
+  int len = pish_redir_op(ps->word);
+
+  while (*tail)
+    tail = &(*tail)->next;
+
+  *tail = r;
+  r->name = strsub(ps->word, len);
+
+  if (ps->word[len] != '\0') {
+    pish_add_word(r, strclo(ps->word + len));
+    pish_lex(ps);
+    return true;
+  }
+
+  pish_lex(ps);
+
+  if (ps->tok != PISH_T_WORD || pish_redir_op(ps->word)) {
+    pish_syntax_error(ps);
+    return false;
+  }
+
+  pish_push_word(r, ps);
+  return true;
+}
+
+/** redirections after a compound command @n */
+static struct pish_node *pish_parse_redirs(struct pish_parser *ps,
+                                           struct pish_node *n) {
+  while (n && !ps->err && ps->tok == PISH_T_WORD && pish_redir_op(ps->word))
+    pish_parse_redir(ps, n);
+
+  return n;
+}
+
+/** ( list ) */
+static struct pish_node *pish_parse_subshell(struct pish_parser *ps) {
+  struct pish_node *n = pish_node_new(PISH_SUBSHELL);
+
+  pish_lex(ps);
+
+  if (!(n->kid = pish_parse_list(ps)) || ps->tok != PISH_T_RPAR)
+    pish_syntax_error(ps);
+  else
+    pish_lex(ps);
+
+  return n;
+}
+
+/** a simple command or a compound command */
+static struct pish_node *pish_parse_command(struct pish_parser *ps) {
+  if (ps->tok == PISH_T_LPAR)
+    return pish_parse_redirs(ps, pish_parse_subshell(ps));
+
+  if (ps->tok != PISH_T_WORD || pish_closing(ps)) {
+    pish_syntax_error(ps);
+    return NULL;
+  }
+
+  if (pish_kw(ps, "if"))
+    return pish_parse_redirs(ps, pish_parse_if(ps));
+
+  if (pish_kw(ps, "while") || pish_kw(ps, "until"))
+    return pish_parse_redirs(ps, pish_parse_while(ps));
+
+  if (pish_kw(ps, "for"))
+    return pish_parse_redirs(ps, pish_parse_for(ps));
+
+  if (pish_kw(ps, "case"))
+    return pish_parse_redirs(ps, pish_parse_case(ps));
+
+  if (pish_kw(ps, "{"))
+    return pish_parse_redirs(ps, pish_parse_group(ps));
+
+  struct pish_node *n = pish_node_new(PISH_CMD);
+  struct pish_node **tail = &n->kid;
+
+  /* leading assignments */
+  while (ps->tok == PISH_T_WORD &&
+         pish_assign_name(ps->word, strcspn(ps->word, "=") + 1)) {
+    *tail = pish_parse_assign(ps);
+    tail = &(*tail)->next;
+  }
+
+  while (ps->tok == PISH_T_WORD) {
+    if (pish_redir_op(ps->word)) {
+      if (!pish_parse_redir(ps, n))
+        break;
+      continue;
+    }
+
+    pish_push_word(n, ps);
+
+    if (n->wc == 1 && !n->kid && !n->redir && ps->tok == PISH_T_LPAR)
+      return pish_parse_func(ps, n);
+  }
+
+  return n;
+}
+
+/** |> ( list ) { ( list ) }, branches of pipeline @n */
+static void pish_parse_fan(struct pish_parser *ps, struct pish_node *n) {
+  struct pish_node **tail = &n->alt;
+
+  pish_lex(ps);
+  pish_linebreak(ps);
+
+  do {
+    if (ps->tok != PISH_T_LPAR) {
+      pish_syntax_error(ps);
+      return;
+    }
+
+    pish_lex(ps);
+    *tail = pish_node_new(PISH_GROUP);
+
+    if (!((*tail)->kid = pish_parse_list(ps)) || ps->tok != PISH_T_RPAR) {
+      pish_syntax_error(ps);
+      return;
+    }
+
+    pish_lex(ps);
+    tail = &(*tail)->next;
+  } while (!ps->err && ps->tok == PISH_T_LPAR);
+}
+
+/** [!] command { | command } [fan] */
+static struct pish_node *pish_parse_pipeline(struct pish_parser *ps) {
+  struct pish_node *n = pish_node_new(PISH_PIPE);
+  struct pish_node **tail = &n->kid;
+
+  n->bang = pish_accept(ps, "!");
+
+  do {
+    pish_linebreak(ps);
+
+    if (!(*tail = pish_parse_command(ps)))
+      break;
+
+    tail = &(*tail)->next;
+  } while (!ps->err && ps->tok == PISH_T_PIPE && (pish_lex(ps), true));
+
+  if (!ps->err && ps->tok == PISH_T_FAN)
+    pish_parse_fan(ps, n);
+
+  return n;
+}
+
+/**
+ * pipeline { (&& | ||) linebreak pipeline }
+ * operators are left associative, a && b || c is (a && b) || c.
+ */
+static struct pish_node *pish_parse_and_or(struct pish_parser *ps) {
+  struct pish_node *n = pish_parse_pipeline(ps);
+
+  while (!ps->err && (ps->tok == PISH_T_AND || ps->tok == PISH_T_OR)) {
+    struct pish_node *op =
+        pish_node_new((ps->tok == PISH_T_AND) ? PISH_AND : PISH_OR);
+
+    pish_lex(ps);
+    pish_linebreak(ps);
+    op->kid = n;
+    op->body = pish_parse_pipeline(ps);
+    n = op;
+  }
+
+  return n;
+}
+
+/**
+ * and_or { (; | newline) and_or } [;]
+ * it stops in front of a closing reserved word, ')', ";;" or end of input.
+ */
+static struct pish_node *pish_parse_list(struct pish_parser *ps) {
+  struct pish_node *head = NULL;
+  struct pish_node **tail = &head;
+
+  pish_linebreak(ps);
+
+  while (!ps->err && (ps->tok == PISH_T_LPAR ||
+                      (ps->tok == PISH_T_WORD && !pish_closing(ps)))) {
+    *tail = pish_parse_and_or(ps);
+    tail = &(*tail)->next;
+
+    if (ps->tok != PISH_T_SEMI && ps->tok != PISH_T_NL)
+      break;
+
+    pish_lex(ps);
+    pish_linebreak(ps);
+  }
+
+  return head;
+}
+
+/**
+ * parse command string @s into a list of nodes stored in @list,
+ * return 0 on success, PISH_EMORE if @s ends inside a construct,
+ * otherwise PISH_ESYNTAX, with a message printed.
+ */
+int pish_parse(const char *s, struct pish_node **list) {
+  struct pish_parser ps = {.p = s};
+
+  pish_lex(&ps);
+  *list = pish_parse_list(&ps);
+
+  if (!ps.err && ps.tok != PISH_T_EOF)
+    ps.err = PISH_ESYNTAX;
+
+  if (ps.err == PISH_ESYNTAX) {
+    const char *near =
+        ps.word ?: (ps.tok == PISH_T_NL) ? "newline" : "end of input";
+
+    if (ps.tok > PISH_T_NL)
+      near = (const char *[]){";", ";;", "|",  "(",
+                              ")", "|>", "&&", "||"}[ps.tok - PISH_T_SEMI];
+
+    fprintf(stderr, "syntax error near `%s'\n", near);
+  }
+
+  free(ps.word);
+
+  if (ps.err) {
+    pish_node_free(*list);
+    *list = NULL;
+  }
+
+  return ps.err;
+}
+
+void pish_update_env(void);
+
+int pish_chdir(char **argv, __unused int fds[2]) {
+  if (!argv[1])
+    return -1;
+
+  int status = chdir(argv[1]);
+
+  if (status == 0) /* so that a script does not look for it every line */
+    pish_update_env();
+
+  return status;
+}
+
+/** print help of builtin @desc */
+static void pish_help_cmd(struct pish_cmd_desc *desc, int fd) {
+  pish_xprintf(fd, "%s:\n", desc->cmdstr);
+
+  for (char **s = desc->helpstr; s && *s; s++)
+    pish_xprintf(fd, "\t%s\n", *s);
+}
+
+int pish_help(__unused char **argv, int fds[2]) {
+  for (size_t i = 0; i < ARRAY_SIZE(pish_builtin_cmd); ++i)
+    pish_help_cmd(&pish_builtin_cmd[i], fds[1]);
+
+  for (size_t i = 0; i < pish_loaded.cap; i++)
+    for (struct ht_ent *e = pish_loaded.bkt[i]; e; e = e->next)
+      pish_help_cmd(e->val, fds[1]);
+
+  return 0;
+}
+
+/** unload builtin @desc loaded by enable -f */
+static void pish_unload(struct pish_cmd_desc *desc) {
+  if (!desc)
+    return;
+
+  dlclose(desc->dl);
+  free(desc->cmdstr);
+  free(desc);
+}
+
+int pish_enable(char **argv, int fds[2]) {
+  int status = 0;
+
+  if (argv[1] == NULL) {
+    for (size_t i = 0; i < ARRAY_SIZE(pish_builtin_cmd); ++i)
+      pish_xprintf(fds[1], "%s\n", pish_builtin_cmd[i].cmdstr);
+
+    for (size_t i = 0; i < pish_loaded.cap; i++)
+      for (struct ht_ent *e = pish_loaded.bkt[i]; e; e = e->next)
+        pish_xprintf(fds[1], "%s\tloaded\n", e->key);
+
+    return 0;
+  }
+
+  if (strcmp(argv[1], "-d") == 0) {
+    for (char **name = &argv[2]; *name; name++) {
+      struct pish_cmd_desc *desc = ht_del(&pish_loaded, *name);
+
+      if (!desc) {
+        fprintf(stderr, "enable: %s is not a loaded builtin\n", *name);
+        status = 1;
+      }
+
+      pish_unload(desc);
+    }
+
+    return status;
+  }
+
+  if (strcmp(argv[1], "-f") != 0 || argv[2] == NULL) {
+    fprintf(stderr, "enable: usage: enable [-f LIB NAME...] [-d NAME...]\n");
+    return 1;
+  }
+
+  for (char **name = &argv[3]; *name; name++) {
+    /* each builtin holds a reference of the library */
+    void *dl = dlopen(argv[2], RTLD_NOW | RTLD_LOCAL);
+    void *exec = dl ? dlsym(dl, *name) : NULL;
+
+    if (!exec) {
+      fprintf(stderr, "enable: %s\n", dlerror());
+      if (dl)
+        dlclose(dl);
+      status = 1;
+      continue;
+    }
+
+    struct pish_cmd_desc *desc = calloc(1, sizeof(struct pish_cmd_desc));
+    char *help = NULL;
+
+    if (asprintf(&help, "%s_help", *name) > 0)
+      desc->helpstr = dlsym(dl, help);
+
+    free(help);
+    desc->cmdstr = strclo(*name);
+    desc->exec = (int (*)(char **, int[2]))exec;
+    desc->dl = dl;
+    pish_unload(ht_put(&pish_loaded, *name, desc));
+  }
+
+  return status;
+}
+
+/* set in a forked subshell, which must not run exit handlers of shell */
+static bool pish_in_subshell;
+
+static void pish_subshell_exit(int status);
+
+int pish_exit(char **argv, __unused int fds[2]) {
+  int status = argv[1] ? strtol(argv[1], NULL, 10) : 0; // given value
+
+  if (pish_in_subshell) /* exit() would seek script input back */
+    pish_subshell_exit(status);
+
+  exit(status);
+}
+
+/**
+ * expand all substrings started with '$' in string @s.
+ * supports recursive $(...) subshell and nonrecursive ${...} subkey.
+ * return a new string, do not forget to free it!
+ */
+char *pish_expand(const char *s) {
+  char **v = sv_fold(s, "$");
+  int n = sv_len(v);
+  int k = (s[0] == '$') ? 0 : 1; /* expand the first token? */
+
+  for (int i = k; i < n; ++i) {
+    char *end = NULL;
+    char *key = NULL;
+    char *val = NULL;
+    char *lb;
+
+    if (v[i][0] == '(') {
+      if (strchp(v[i], '(', ')') == 0) /* balanced ? */
+      {
+        end = strrchr(v[i], ')');
+        char *cmd = strsub(&v[i][1], end - &v[i][1]);
+        val = pish_fifo(cmd, NULL);
+
+        free(cmd);
+      } else if (i + 1 < n) /* unbalanced, defer it to subshell */
+      {
+        /*
+         * transform:      fold           unfold
+         *  $ ( S $ ( S ) ) => ( S | ( S ) ) => | ( S $ ( S ) )
+         */
+        val = sv_unfold((char *[]){v[i], v[i + 1], NULL}, "$", "", "");
+        free(v[i]);
+        v[i] = strclo("");
+        free(v[i + 1]); // just replace
+        v[i + 1] = val;
+        continue;
+      } else
+        goto out;
+    } else {
+      if (v[i][0] == '{' && (end = strchr(v[i], '}')))
+        key = strsub(&v[i][1], end - &v[i][1]);
+      else { /* a bare key ends at the first character out of a name */
+        char *e = v[i];
+
+        if (strchr("?#@*", *e) || isdigit(*e))
+          e++;
+        else
+          while (isalnum(*e) || *e == '_')
+            e++;
+
+        key = strsub(v[i], e - v[i]);
+        end = e - 1;
+      }
+
+      if (*key == '\0')
+        val = strclo("$");
+      else if (*key == '?')
+        val = strclo(pish_status);
+      else if (*key == '#' && key[1] == '\0')
+        asprintf(&val, "%d", pish_argc - 1);
+      else if (*key == '#') { /* count of array, or length of value */
+        struct pish_array *a;
+
+        if ((lb = strchr(key, '['))) {
+          *lb = '\0';
+          a = ht_get(&pish_arrays, key + 1);
+          asprintf(&val, "%d", a ? a->n : 0);
+        } else
+          asprintf(&val, "%zu", strlen(getenv(key + 1) ?: ""));
+      } else if (*key == '@' || *key == '*') {
+        if (pish_argc > 1)
+          val = sv_unfold(&pish_argv[1], " ", NULL, NULL);
+      } else if ((lb = strchr(key, '['))) { /* an array element */
+        struct pish_array *a;
+        long m = strtol(lb + 1, NULL, 10);
+
+        *lb = '\0';
+
+        if (!(a = ht_get(&pish_arrays, key)))
+          ;
+        else if (lb[1] == '@' || lb[1] == '*')
+          val = sv_unfold(a->v, " ", NULL, NULL);
+        else if (m >= 0 && m < a->n)
+          val = strclo(a->v[m]);
+      } else if (isdigit(*key)) {
+        int m = c2oct(*key);
+        if (m < pish_argc)
+          val = strclo(pish_argv[m]);
+      } else
+        val = strclo(getenv(key) ?: "");
+
+      free(key);
+    }
+
+    if (!val)
+      val = strclo("");
+
+    /* concat ending part */
+    char *es;
+
+    if (end)
+      es = sv_unfold((char *[]){val, end + 1, NULL}, NULL, NULL, NULL);
+    else
+      es = strclo(val);
+
+    free(val);
+    /* replace string */
+    free(v[i]);
+    v[i] = es;
+  }
+
+  char *js;
+out:
+  js = sv_unfold(v, NULL, NULL, NULL); /* join substrings */
+  sv_free(v);
+  return js;
+}
+
+extern char **environ;
+
+/* options toggled by set -o */
+static bool pish_autosplit;
+static bool pish_flowstat;
+
+static struct {
+  const char *name;
+  bool *on;
+} pish_options[] = {
+    {"autosplit", &pish_autosplit},
+    {"flowstat", &pish_flowstat},
+};
+
+int pish_set(char **argv, int fds[2]) {
+  if (argv[1] != NULL && strchr("-+", argv[1][0]) && argv[1][1] == 'o' &&
+      argv[1][2] == '\0') {
+    for (size_t i = 0; i < ARRAY_SIZE(pish_options); i++) {
+      if (argv[2] == NULL)
+        pish_xprintf(fds[1], "%s\t%s\n", pish_options[i].name,
+                *pish_options[i].on ? "on" : "off");
+      else if (strcmp(argv[2], pish_options[i].name) == 0) {
+        *pish_options[i].on = (argv[1][0] == '-');
+        return 0;
+      }
+    }
+
+    if (argv[2] == NULL)
+      return 0;
+
+    fprintf(stderr, "set: unknown option %s\n", argv[2]);
+    return 1;
+  } else if (argv[1] != NULL) {
+    if (argv[2] != NULL)
+      setenv(argv[1], argv[2], 1);
+    else
+      setenv(argv[1], "", 1);
+  } else { // print environ
+    char **p = environ;
+
+    while (*p != NULL)
+      pish_xprintf(fds[1], "%s\n", *p++);
+  }
+
+  return 0;
+}
+
+int pish_unset(char **argv, __unused int fds[2]) {
+  if (argv[1] != NULL && strcmp(argv[1], "-f") == 0) {
+    if (argv[2] != NULL)
+      pish_node_free(ht_del(&pish_funcs, argv[2]));
+  } else if (argv[1] != NULL) {
+    unsetenv(argv[1]); // replace
+    pish_array_free(ht_del(&pish_arrays, argv[1]));
+  }
+
+  return 0;
+}
+
+/**
+ * read-ahead buffer of an input fd, so that line oriented builtins
+ * do not read byte by byte. a regular file is mapped into memory,
+ * and the file offset is given back after use, other inputs are
+ * read in large blocks, where data read ahead stays in the buffer
+ * for the next builtin reading the same fd.
+ */
+struct pish_rbuf {
+  int fd;
+  dev_t dev; /* identity of the open file, as fd numbers are reused */
+  ino_t ino;
+  char *buf; /* block buffer, or mapped file */
+  size_t cap;
+  size_t pos; /* unread data in [pos, len) */
+  size_t len;
+  bool map;
+  bool share; /* children read the same fd, nothing is read ahead */
+  bool peek;  /* a shared pipe, read ahead by tee(2) into @tee */
+  int tee[2];
+  size_t held; /* data at end of buffer which is still in the pipe */
+};
+
+#define PISH_RBUF_BLOCK (64 * 1024)
+
+/* read-ahead buffers indexed by fd */
+static struct pish_rbuf **pish_rbufs;
+static int pish_nrbufs;
+
+/* script shared with commands, given to them once one may read it */
+static struct pish_rbuf *pish_rbuf_shared;
+static bool pish_rbuf_given;
+
+static void pish_rbuf_reset(struct pish_rbuf *rb) {
+  if (rb->map)
+    munmap(rb->buf, rb->cap);
+  else
+    free(rb->buf);
+
+  if (rb->peek) {
+    close(rb->tee[0]);
+    close(rb->tee[1]);
+  }
+
+  rb->buf = NULL;
+  rb->cap = rb->pos = rb->len = rb->held = 0;
+  rb->map = rb->share = rb->peek = false;
+}
+
+static void pish_rbuf_free(struct pish_rbuf *rb) {
+  if (rb) {
+    pish_rbuf_reset(rb);
+    free(rb);
+  }
+}
+
+/**
+ * get read-ahead buffer of @fd, a stale one left by a closed file
+ * of the same fd number is dropped. return NULL if @fd is not readable.
+ * a channel keeps its own buffer.
+ */
+static void pish_rbuf_give(void);
+
+struct pish_rbuf *pish_rbuf_get(int fd) {
+  struct stat st;
+
+  if (pish_isvfd(fd)) {
+    struct pish_chan *c = pish_chan(fd);
+
+    if (!c->rb)
+      c->rb = calloc(1, sizeof(struct pish_rbuf));
+
+    c->rb->fd = fd;
+    return c->rb;
+  }
+
+  if (fd < 0 || fstat(fd, &st) < 0)
+    return NULL;
+
+  if (pish_rbuf_shared && pish_rbuf_shared->fd == fd)
+    pish_rbuf_give();
+
+  if (fd >= pish_nrbufs) {
+    int n = fd + 16;
+
+    pish_rbufs = realloc(pish_rbufs, n * sizeof(struct pish_rbuf *));
+    memset(&pish_rbufs[pish_nrbufs], 0,
+           (n - pish_nrbufs) * sizeof(struct pish_rbuf *));
+    pish_nrbufs = n;
+  }
+
+  struct pish_rbuf *rb = pish_rbufs[fd];
+
+  if (!rb)
+    rb = pish_rbufs[fd] = calloc(1, sizeof(struct pish_rbuf));
+  else if (rb->dev != st.st_dev || rb->ino != st.st_ino)
+    pish_rbuf_reset(rb);
+
+  rb->fd = fd;
+  rb->dev = st.st_dev;
+  rb->ino = st.st_ino;
+
+  if (S_ISREG(st.st_mode)) { /* map it, reading from current offset */
+    off_t off = lseek(fd, 0, SEEK_CUR);
+
+    if ((size_t)st.st_size != rb->cap || !rb->map) {
+      pish_rbuf_reset(rb);
+
+      if (st.st_size > 0) {
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (p == MAP_FAILED)
+          return NULL;
+
+        madvise(p, st.st_size, MADV_SEQUENTIAL);
+        rb->buf = p;
+        rb->cap = rb->len = st.st_size;
+      }
+
+      rb->map = true;
+    }
+
+    rb->pos = (off < 0 || (size_t)off > rb->len) ? rb->len : (size_t)off;
+  } else if (rb->map)
+    pish_rbuf_reset(rb);
+
+  return rb;
+}
+
+/**
+ * share @rb with children reading the same fd, see pish_rbuf_sync().
+ * a mapped file is given its offset back, a pipe is peeked with tee(2)
+ * and only what is used is read off, other inputs are read bytewise.
+ */
+static void pish_rbuf_share(struct pish_rbuf *rb) {
+  struct stat st;
+
+  if (rb->share || rb->map || pish_isvfd(rb->fd))
+    return;
+
+  rb->share = true;
+
+  if (fstat(rb->fd, &st) == 0 && S_ISFIFO(st.st_mode) &&
+      pipe2(rb->tee, O_CLOEXEC) == 0)
+    rb->peek = true;
+}
+
+/** read data of a shared pipe, which is held in buffer, off the pipe */
+static void pish_rbuf_eat(struct pish_rbuf *rb, size_t len) {
+  char *p = rb->buf + rb->len - rb->held; /* the same data again */
+
+  while (len > 0) {
+    ssize_t n = pish_xread(rb->fd, p, len);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    if (n <= 0)
+      break;
+
+    len -= n;
+    rb->held -= n;
+    p += n;
+  }
+}
+
+/** peek up to @len bytes of a shared pipe into @p, nothing is held */
+static ssize_t pish_rbuf_peek(struct pish_rbuf *rb, char *p, size_t len) {
+  ssize_t n = tee(rb->fd, rb->tee[1], len, 0);
+
+  if (n > 0 && (n = pish_xread(rb->tee[0], p, n)) > 0)
+    rb->held = n;
+
+  return n;
+}
+
+/**
+ * get next line of @rb into @line with length @len, including its
+ * newline if there is one, it is valid until the buffer is used again.
+ * return false at end of input.
+ */
+bool pish_rbuf_line(struct pish_rbuf *rb, const char **line, size_t *len) {
+  size_t scan = rb->pos;
+  char *nl = NULL;
+
+  while (scan >= rb->len ||
+         !(nl = memchr(rb->buf + scan, '\n', rb->len - scan))) {
+    if (rb->map)
+      break;
+
+    if (rb->peek) /* all of it is used, tee(2) always starts at pipe head */
+      pish_rbuf_eat(rb, rb->held);
+
+    /* move unread data to front, and fill the rest with a large read */
+    if (rb->pos > 0)
+      memmove(rb->buf, rb->buf + rb->pos, rb->len - rb->pos);
+
+    rb->len -= rb->pos;
+    scan = rb->len;
+    rb->pos = 0;
+
+    if (rb->cap - rb->len < PISH_RBUF_BLOCK) {
+      rb->cap = rb->cap ? rb->cap * 2 : 2 * PISH_RBUF_BLOCK;
+      rb->buf = realloc(rb->buf, rb->cap);
+    }
+
+    size_t max = rb->share ? 1 : rb->cap - rb->len;
+    ssize_t n =
+        rb->peek ? pish_rbuf_peek(rb, rb->buf + rb->len, rb->cap - rb->len)
+                 : pish_xread(rb->fd, rb->buf + rb->len, max);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    if (n <= 0)
+      break;
+
+    rb->len += n;
+  }
+
+  size_t end = nl ? (size_t)(nl + 1 - rb->buf) : rb->len;
+
+  if (end == rb->pos)
+    return false;
+
+  *line = rb->buf + rb->pos;
+  *len = end - rb->pos;
+  rb->pos = end;
+  return true;
+}
+
+/**
+ * give consumed offset back to a mapped file, or read what is consumed
+ * off a shared pipe and forget the rest, which a child may take.
+ */
+void pish_rbuf_sync(struct pish_rbuf *rb) {
+  if (rb->map)
+    lseek(rb->fd, rb->pos, SEEK_SET);
+  else if (rb->peek) {
+    if (rb->pos > rb->len - rb->held)
+      pish_rbuf_eat(rb, rb->pos - (rb->len - rb->held));
+
+    rb->len = rb->pos;
+    rb->held = 0;
+  }
+}
+
+/** leave the shared script at the end of the running command */
+static void pish_rbuf_give(void) {
+  if (pish_rbuf_shared && !pish_rbuf_given && !pish_in_task) {
+    pish_rbuf_given = true;
+    pish_rbuf_sync(pish_rbuf_shared);
+  }
+}
+
+/**
+ * read a line from @fds[0], split it by PISH_IFS into variables
+ * in @argv, the last one takes the rest of line.
+ */
+int pish_read(char **argv, int fds[2]) {
+  struct pish_rbuf *rb = pish_rbuf_get(fds[0]);
+  const char *line;
+  size_t len;
+  int i = 1;
+
+  if (argv[i] && strcmp(argv[i], "-r") == 0) /* always raw */
+    i++;
+
+  if (!rb || !pish_rbuf_line(rb, &line, &len))
+    return 1;
+
+  pish_rbuf_sync(rb);
+
+  if (len > 0 && line[len - 1] == '\n')
+    len--;
+
+  char *s = strsub(line, len);
+  char *p = s;
+  char **names = argv[i] ? &argv[i] : STRV("REPLY");
+
+  for (; *names; names++) {
+    char *e;
+
+    p += strspn(p, PISH_IFS);
+
+    if (names[1]) { /* take a field */
+      e = p + strcspn(p, PISH_IFS);
+
+      if (*e != '\0')
+        *e++ = '\0';
+    } else { /* take the rest, without trailing blanks */
+      e = p + strlen(p);
+
+      while (e > p && strchr(PISH_IFS, e[-1]))
+        e--;
+
+      *e = '\0';
+    }
+
+    setenv(*names, p, 1);
+    p = e;
+  }
+
+  free(s);
+  return 0;
+}
+
+/**
+ * read lines from @fds[0] into an array.
+ * /mapfile [-t] [-n N] [A]/, -t strips newlines, -n reads at most N lines,
+ * the array is named MAPFILE by default.
+ */
+int pish_mapfile(char **argv, int fds[2]) {
+  bool strip = false;
+  long max = -1;
+  int i = 1;
+
+  for (; argv[i] && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-t") == 0)
+      strip = true;
+    else if (strcmp(argv[i], "-n") == 0 && argv[i + 1])
+      max = strtol(argv[++i], NULL, 10);
+    else {
+      fprintf(stderr, "%s: unknown option %s\n", argv[0], argv[i]);
+      return 2;
+    }
+  }
+
+  struct pish_array *a = pish_array_new(argv[i] ?: "MAPFILE");
+  struct pish_rbuf *rb = pish_rbuf_get(fds[0]);
+  const char *line;
+  size_t len;
+
+  if (!rb)
+    return 1;
+
+  while (max-- != 0 && pish_rbuf_line(rb, &line, &len)) {
+    if (strip && line[len - 1] == '\n')
+      len--;
+
+    pish_array_push(a, strsub(line, len));
+  }
+
+  pish_rbuf_sync(rb);
+  return 0;
+}
+
+#define PISH_RLIM_MAX 16
+
+/** attributes given by sched or ulimit to a child */
+struct pish_sched {
+  bool cpus_set;
+  cpu_set_t cpus;
+  bool nice_set;
+  int nice;
+  int ioprio; /* IOPRIO_PRIO_VALUE(class, level), or -1 */
+  int policy; /* or -1 */
+  int prio;
+  bool soft; /* limits below change soft ones */
+  bool hard; /* and hard ones */
+  int nlim;
+  struct {
+    char opt; /* option of ulimit setting it */
+    int res;
+    rlim_t val;
+  } lim[PISH_RLIM_MAX];
+};
+
+#define PISH_IOPRIO(class, level) (((class) << 13) | (level))
+
+/* attributes for children started next by this thread, or NULL */
+static __thread struct pish_sched *pish_sched_next;
+
+/** parse cpu list @s like 0-3,8 into @set, return false if it is bad */
+static bool pish_sched_cpus(const char *s, cpu_set_t *set) {
+  CPU_ZERO(set);
+
+  while (*s) {
+    char *end;
+    long lo = strtol(s, &end, 10);
+    long hi = lo;
+
+    if (end == s || lo < 0)
+      return false;
+
+    if (*end == '-' && (hi = strtol(end + 1, &end, 10)) < lo)
+      return false;
+
+    for (long c = lo; c <= hi && c < CPU_SETSIZE; c++)
+      CPU_SET(c, set);
+
+    if (*end != ',' && *end != '\0')
+      return false;
+
+    s = end + (*end == ',');
+  }
+
+  return CPU_COUNT(set) > 0;
+}
+
+/** parse I/O class @s like idle, be:4 or rt:0, -1 if it is bad */
+static int pish_sched_io(const char *s) {
+  static const char *classes[] = {"none", "rt", "be", "idle"};
+  static const char *names[] = {"none", "realtime", "best-effort", "idle"};
+  size_t len = strcspn(s, ":");
+  long level = 4;
+
+  if (s[len] == ':') {
+    char *end;
+
+    level = strtol(s + len + 1, &end, 10);
+
+    if (end == s + len + 1 || *end != '\0' || level < 0 || level > 7)
+      return -1;
+  }
+
+  for (int c = 0; c < 4; c++)
+    if ((strncmp(s, classes[c], len) == 0 && !classes[c][len]) ||
+        (strncmp(s, names[c], len) == 0 && !names[c][len]))
+      return PISH_IOPRIO(c, (c == 3) ? 0 : level);
+
+  return -1;
+}
+
+/**
+ * parse options of sched in @argv into @sc,
+ * return index of the command, or -1 with a message.
+ */
+static int pish_sched_parse(char **argv, struct pish_sched *sc) {
+  static const char *policies[] = {"other", "fifo", "rr", "batch", NULL,
+                                    "idle"};
+  int i = 1;
+
+  memset(sc, 0, sizeof(*sc));
+  sc->ioprio = sc->policy = -1;
+
+  for (; argv[i] && strncmp(argv[i], "--", 2) == 0; i += 2) {
+    const char *o = argv[i] + 2;
+    const char *v = argv[i + 1];
+    bool ok = (v != NULL);
+
+    if (!*o) /* -- */
+      return i + 1;
+
+    if (ok && strcmp(o, "cpus") == 0)
+      ok = sc->cpus_set = pish_sched_cpus(v, &sc->cpus);
+    else if (ok && strcmp(o, "nice") == 0) {
+      sc->nice_set = true;
+      sc->nice = strtol(v, (char **)&o, 10);
+      ok = (*o == '\0' && o != v);
+    } else if (ok && strcmp(o, "ionice") == 0)
+      ok = (sc->ioprio = pish_sched_io(v)) >= 0;
+    else if (ok && strcmp(o, "policy") == 0) {
+      for (size_t p = 0; p < ARRAY_SIZE(policies); p++)
+        if (policies[p] && strcmp(v, policies[p]) == 0)
+          sc->policy = p;
+
+      ok = (sc->policy >= 0);
+    } else if (ok && strcmp(o, "prio") == 0) {
+      sc->prio = strtol(v, (char **)&o, 10);
+      ok = (*o == '\0' && o != v);
+    } else
+      ok = false;
+
+    if (!ok) {
+      fprintf(stderr, "sched: bad option %s %s\n", argv[i], v ?: "");
+      return -1;
+    }
+  }
+
+  return i;
+}
+
+/** give @sc to the calling process, return false with a message */
+static bool pish_sched_apply(struct pish_sched *sc) {
+  const char *what = NULL;
+
+  if (sc->policy >= 0) {
+    struct sched_param sp = {.sched_priority = sc->prio};
+
+    if (!sp.sched_priority &&
+        (sc->policy == SCHED_FIFO || sc->policy == SCHED_RR))
+      sp.sched_priority = 1;
+
+    if (sched_setscheduler(0, sc->policy, &sp) < 0)
+      what = "policy";
+  }
+
+  if (!what && sc->nice_set && setpriority(PRIO_PROCESS, 0, sc->nice) < 0)
+    what = "nice";
+
+  if (!what && sc->ioprio >= 0 &&
+      syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, sc->ioprio) < 0)
+    what = "ionice";
+
+  if (!what && sc->cpus_set &&
+      sched_setaffinity(0, sizeof(cpu_set_t), &sc->cpus) < 0)
+    what = "cpus";
+
+  for (int i = 0; !what && i < sc->nlim; i++) {
+    struct rlimit rl;
+
+    getrlimit(sc->lim[i].res, &rl);
+
+    if (sc->soft)
+      rl.rlim_cur = sc->lim[i].val;
+
+    if (sc->hard)
+      rl.rlim_max = sc->lim[i].val;
+
+    if (setrlimit(sc->lim[i].res, &rl) < 0) {
+      fprintf(stderr, "ulimit: -%c: %s\n", sc->lim[i].opt, strerror(errno));
+      return false;
+    }
+  }
+
+  if (what)
+    fprintf(stderr, "sched: %s: %s\n", what, strerror(errno));
+
+  return !what;
+}
+
+/** a resource known by ulimit */
+static const struct pish_rlim {
+  char opt;
+  int res;
+  int unit; /* bytes of a unit */
+  const char *name;
+} pish_rlims[] = {
+    {'c', RLIMIT_CORE, 1024, "core file size (KiB)"},
+    {'d', RLIMIT_DATA, 1024, "data seg size (KiB)"},
+    {'f', RLIMIT_FSIZE, 1024, "file size (KiB)"},
+    {'l', RLIMIT_MEMLOCK, 1024, "max locked memory (KiB)"},
+    {'m', RLIMIT_RSS, 1024, "max memory size (KiB)"},
+    {'n', RLIMIT_NOFILE, 1, "open files"},
+    {'s', RLIMIT_STACK, 1024, "stack size (KiB)"},
+    {'t', RLIMIT_CPU, 1, "cpu time (seconds)"},
+    {'u', RLIMIT_NPROC, 1, "max user processes"},
+    {'v', RLIMIT_AS, 1024, "virtual memory (KiB)"},
+};
+
+/** parse limit @s of resource @r into @val, false if it is not one */
+static bool pish_rlim_value(const char *s, const struct pish_rlim *r,
+                            rlim_t *val) {
+  char *end;
+
+  if (!s)
+    return false;
+
+  if (strcmp(s, "unlimited") == 0) {
+    *val = RLIM_INFINITY;
+    return true;
+  }
+
+  if (!isdigit((unsigned char)*s))
+    return false;
+
+  unsigned long long v = strtoull(s, &end, 10);
+
+  *val = (v > RLIM_INFINITY / r->unit) ? RLIM_INFINITY : v * r->unit;
+  return *end == '\0';
+}
+
+/**
+ * parse options of ulimit in @argv into limits to set in @sc, and the
+ * ones to show in @show, of which there are @nshow, return index of
+ * the command, or -1 with a message.
+ */
+static int pish_ulimit_parse(char **argv, struct pish_sched *sc,
+                             const struct pish_rlim **show, int *nshow) {
+  const int nrlims = ARRAY_SIZE(pish_rlims);
+  const struct pish_rlim *r = NULL;
+  int i = 1;
+
+  memset(sc, 0, sizeof(*sc));
+  sc->ioprio = sc->policy = -1;
+  *nshow = 0;
+
+  for (; argv[i]; i++) {
+    rlim_t val;
+
+    if (strcmp(argv[i], "--") == 0) {
+      i++;
+      break;
+    }
+
+    if (argv[i][0] != '-' || !argv[i][1]) {
+      if (!pish_rlim_value(argv[i], r ?: &pish_rlims[2], &val))
+        break; /* the command */
+
+      if (sc->nlim == PISH_RLIM_MAX) {
+        fprintf(stderr, "ulimit: too many limits\n");
+        return -1;
+      }
+
+      /* a value is for the last resource, which is shown no more */
+      sc->lim[sc->nlim].opt = (r ?: &pish_rlims[2])->opt;
+      sc->lim[sc->nlim].res = (r ?: &pish_rlims[2])->res;
+      sc->lim[sc->nlim++].val = val;
+
+      if (r && *nshow && show[*nshow - 1] == r)
+        (*nshow)--;
+
+      r = NULL;
+      continue;
+    }
+
+    for (const char *o = &argv[i][1]; *o; o++) {
+      if (*o == 'H')
+        sc->hard = true;
+      else if (*o == 'S')
+        sc->soft = true;
+      else if (*o == 'a') {
+        for (size_t k = 0; k < ARRAY_SIZE(pish_rlims); k++)
+          show[k] = &pish_rlims[k];
+
+        *nshow = ARRAY_SIZE(pish_rlims);
+      } else {
+        r = NULL;
+
+        for (size_t k = 0; k < ARRAY_SIZE(pish_rlims); k++)
+          if (pish_rlims[k].opt == *o)
+            r = &pish_rlims[k];
+
+        if (!r) {
+          fprintf(stderr, "ulimit: bad option -%c\n", *o);
+          return -1;
+        }
+
+        if (*nshow < nrlims)
+          show[(*nshow)++] = r;
+      }
+    }
+  }
+
+  if (!sc->soft && !sc->hard) /* set both, show the soft one */
+    sc->soft = sc->hard = true;
+
+  return i;
+}
+
+/**
+ * fork a child process to execute @argv,
+ * redirect its stdin to @fds[0] and stdout to @fds[1]
+ */
+int pish_fork(char **argv, int fds[2]) {
+  struct pish_sched *sc = pish_sched_next;
+
+  pish_rbuf_give();
+
+  int pid = vfork();
+
+  if (pid == 0) {
+    signal(SIGPIPE, SIG_DFL); /* ignored by shell for its builtins */
+
+    if (sc && !pish_sched_apply(sc))
+      _exit(126);
+
+    dup2(fds[0], fileno(stdin));
+    dup2(fds[1], fileno(stdout));
+
+    int status = execvp(argv[0], argv);
+
+    fprintf(stderr, "failed to execute %s, ret = %d\n", argv[0], status);
+    _exit(status);
+  }
+
+  return pid;
+}
+
+/** wait for child @pid, return its exit status */
+int pish_wait(pid_t pid) {
+  int status;
+
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR)
+      return -1;
+  }
+
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+
+  return WEXITSTATUS(status);
+}
+
+/** find builtin command named @name, loaded builtins come first */
+struct pish_cmd_desc *pish_builtin(const char *name) {
+  struct pish_cmd_desc *desc = ht_get(&pish_loaded, name);
+
+  if (desc)
+    return desc;
+
+  for (size_t j = 0; j < ARRAY_SIZE(pish_builtin_cmd); j++) {
+    if (strcmp(name, pish_builtin_cmd[j].cmdstr) == 0)
+      return &pish_builtin_cmd[j];
+  }
+
+  return NULL;
+}
+
+int pish_echo(char **argv, int fds[2]) {
+  bool nl = true;
+  int i = 1;
+
+  /* -e and -E are taken, as quoted strings have escapes converted */
+  for (; argv[i] && argv[i][0] == '-' && argv[i][1] &&
+         strspn(argv[i] + 1, "neE") == strlen(argv[i] + 1);
+       i++)
+    nl = nl && !strchr(argv[i], 'n');
+
+  char *s = sv_unfold(&argv[i], " ", NULL, nl ? "\n" : NULL);
+  int status = 0;
+
+  /* one write, so that a line is never split among others */
+  if (s && pish_xwrite(fds[1], s, strlen(s)) < 0)
+    status = 1;
+  else if (!s && nl && pish_xwrite(fds[1], "\n", 1) < 0)
+    status = 1;
+
+  free(s);
+  return status;
+}
+
+/**
+ * printf, a conversion takes the next argument, or "" or 0 if there is
+ * none, and the format is used again while arguments remain.
+ */
+int pish_printf(char **argv, int fds[2]) {
+  char **args = argv[1] ? &argv[2] : NULL;
+  char *out = NULL;
+  size_t len = 0;
+  FILE *f;
+
+  if (!args) {
+    fprintf(stderr, "printf: usage: printf FMT [ARGS]\n");
+    return 1;
+  }
+
+  f = open_memstream(&out, &len);
+
+  do {
+    char **from = args;
+
+    for (const char *p = argv[1]; *p; p++) {
+      if (*p == '\\' && p[1]) { /* escapes out of quotes */
+        const char *e = strchr("n\nt\t\\\\", *++p);
+
+        fputc(e ? e[1] : *p, f);
+        continue;
+      }
+
+      if (*p != '%' || p[1] == '\0') {
+        fputc(*p, f);
+        continue;
+      }
+
+      if (*++p == '%') {
+        fputc('%', f);
+        continue;
+      }
+
+      /* flags, width and precision, then conversion */
+      const char *q = p + strspn(p, "-+ #0");
+
+      q += strspn(q, "0123456789");
+
+      if (*q == '.')
+        q += 1 + strspn(q + 1, "0123456789");
+
+      char *spec;
+      const char *arg = *args ? *args++ : NULL;
+
+      if (asprintf(&spec, "%%%.*s%s%c", (int)(q - p), p,
+                   strchr("diuoxX", *q) ? "l" : "", *q) < 0)
+        break;
+
+      switch (*q) {
+      case 'd':
+      case 'i':
+        fprintf(f, spec, arg ? strtol(arg, NULL, 0) : 0L);
+        break;
+      case 'u':
+      case 'o':
+      case 'x':
+      case 'X':
+        fprintf(f, spec, arg ? strtoul(arg, NULL, 0) : 0UL);
+        break;
+      case 'c':
+        fprintf(f, spec, arg ? arg[0] : '\0');
+        break;
+      case 'b':
+        spec[strlen(spec) - 1] = 's';
+        /* fall through */
+      case 's':
+        fprintf(f, spec, arg ?: "");
+        break;
+      default:
+        fprintf(stderr, "printf: %%%c: invalid conversion\n", *q);
+        free(spec);
+        fclose(f);
+        free(out);
+        return 1;
+      }
+
+      free(spec);
+      p = q;
+    }
+
+    if (args == from) /* no conversion, never loop */
+      break;
+  } while (*args);
+
+  fclose(f);
+
+  int status = (len > 0 && pish_xwrite(fds[1], out, len) < 0);
+
+  free(out);
+  return status;
+}
+
+#define PISH_COPY_BLOCK (1 << 20)
+
+/**
+ * copy @in to @out until end of input. when both are real fds, data is
+ * moved in kernel by splice if either is a pipe, by copy_file_range
+ * between regular files, or by sendfile from a regular file, otherwise
+ * it goes through a large buffer. return -1 on error.
+ */
+static int pish_copy(int in, int out) {
+  struct stat si;
+  struct stat so;
+  ssize_t n = -1;
+
+  if (!pish_isvfd(in) && !pish_isvfd(out) && fstat(in, &si) == 0 &&
+      fstat(out, &so) == 0) {
+    errno = 0; /* set only by a copy which runs, and fails */
+
+    if (S_ISFIFO(si.st_mode) || S_ISFIFO(so.st_mode))
+      while ((n = splice(in, NULL, out, NULL, PISH_COPY_BLOCK,
+                         SPLICE_F_MOVE | SPLICE_F_MORE)) > 0)
+        ;
+    else if (S_ISREG(si.st_mode) && S_ISREG(so.st_mode))
+      while ((n = copy_file_range(in, NULL, out, NULL, PISH_COPY_BLOCK, 0)) >
+             0)
+        ;
+    else if (S_ISREG(si.st_mode))
+      while ((n = sendfile(out, in, NULL, PISH_COPY_BLOCK)) > 0)
+        ;
+
+    if (n == 0)
+      return 0;
+
+    if (n < 0 && errno == EPIPE)
+      return -1;
+  }
+
+  /* not supported by these fds, go on from where it stops */
+  char *buf = malloc(PISH_COPY_BLOCK);
+
+  while ((n = pish_xread(in, buf, PISH_COPY_BLOCK)) > 0 ||
+         (n < 0 && errno == EINTR)) {
+    if (n > 0 && pish_xwrite(out, buf, n) < 0) {
+      n = -1;
+      break;
+    }
+  }
+
+  free(buf);
+  return (n < 0) ? -1 : 0;
+}
+
+/** fds to pump data between */
+struct pish_pump {
+  int in;
+  int out;
+};
+
+static void *pish_pump_run(void *arg) {
+  struct pish_pump *p = arg;
+
+  pish_copy(p->in, p->out);
+  close(p->out);
+  return NULL;
+}
+
+/**
+ * run external command @argv on @fds and wait for it, for builtins
+ * which leave options they do not know to the real command.
+ * ends of channels are bridged to the child by pipes.
+ */
+int pish_extern(char **argv, int fds[2]) {
+  int real[2] = {fds[0], fds[1]};
+  int in[2];
+  int out[2];
+  struct pish_pump pump = {fds[0], -1};
+  pthread_t tid;
+  bool pin = pish_isvfd(fds[0]);
+  bool pout = pish_isvfd(fds[1]);
+
+  if (pin) {
+    pipe2(in, O_CLOEXEC);
+    real[0] = in[0];
+  }
+
+  if (pout) {
+    pipe2(out, O_CLOEXEC);
+    real[1] = out[1];
+  }
+
+  pid_t pid = pish_fork(argv, real);
+
+  if (pin) {
+    close(in[0]);
+    pump.out = in[1];
+    pthread_create(&tid, NULL, pish_pump_run, &pump);
+  }
+
+  if (pout) {
+    close(out[1]);
+    pish_copy(out[0], fds[1]);
+    close(out[0]);
+  }
+
+  int status = (pid > 0) ? pish_wait(pid) : 127;
+
+  if (pin)
+    pthread_join(tid, NULL);
+
+  return status;
+}
+
+/**
+ * take data read ahead from @fd by the shell, which comes before
+ * anything read from @fd, store it in @buf and return its length.
+ */
+static size_t pish_rbuf_pending(int fd, const char **buf) {
+  struct pish_rbuf *rb = NULL;
+  struct stat st;
+
+  if (pish_in_task || pish_isvfd(fd) || fd < 0 || fd >= pish_nrbufs ||
+      !(rb = pish_rbufs[fd]) || rb->map || rb->peek || rb->pos >= rb->len ||
+      fstat(fd, &st) < 0 || rb->dev != st.st_dev || rb->ino != st.st_ino)
+    return 0;
+
+  size_t len = rb->len - rb->pos;
+
+  *buf = rb->buf + rb->pos;
+  rb->pos = rb->len;
+  return len;
+}
+
+/** write data read ahead from @fd to @out, so that no input is lost */
+static void pish_rbuf_flush(int fd, int out) {
+  const char *buf;
+  size_t len = pish_rbuf_pending(fd, &buf);
+
+  if (len)
+    pish_xwrite(out, buf, len);
+}
+
+int pish_cat(char **argv, int fds[2]) {
+  int status = 0;
+  int i = 1;
+
+  for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+    if (strcmp(argv[i], "--") == 0) {
+      i++;
+      break;
+    }
+
+    if (strcmp(argv[i], "-u") != 0) /* unbuffered anyway */
+      return pish_extern(argv, fds);
+  }
+
+  char *dash[] = {argv[0], "-", NULL};
+
+  if (!argv[i])
+    argv = dash;
+
+  for (; argv[i]; i++) {
+    bool in = (strcmp(argv[i], "-") == 0);
+    int fd = in ? fds[0] : open(argv[i], O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+      fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(errno));
+      status = 1;
+      continue;
+    }
+
+    if (in)
+      pish_rbuf_flush(fd, fds[1]);
+
+    int err = pish_copy(fd, fds[1]) < 0 ? errno : 0;
+
+    if (!in)
+      close(fd);
+
+    if (err) {
+      status = 1;
+
+      if (err == EPIPE)
+        break;
+
+      fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(err));
+    }
+  }
+
+  return status;
+}
+
+/**
+ * give @n bytes of pipe @in to @fd, which tee(2) has just duplicated
+ * to output, by splice, or through @buf if @fd takes no splice.
+ */
+static int pish_tee_give(int in, int fd, ssize_t n, char *buf) {
+  while (n > 0) {
+    ssize_t m = splice(in, NULL, fd, NULL, n, SPLICE_F_MOVE);
+
+    if (m < 0 && errno == EINTR)
+      continue;
+
+    if (m <= 0) {
+      if ((m = read(in, buf, n < PISH_COPY_BLOCK ? n : PISH_COPY_BLOCK)) <= 0)
+        return -1;
+
+      pish_xwrite(fd, buf, m);
+    }
+
+    n -= m;
+  }
+
+  return 0;
+}
+
+int pish_tee(char **argv, int fds[2]) {
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC | O_TRUNC;
+  int status = 0;
+  int nf = 0;
+  int i = 1;
+  ssize_t n = -1;
+  struct stat si;
+  struct stat so;
+
+  for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+    if (strcmp(argv[i], "--") == 0) {
+      i++;
+      break;
+    } else if (strcmp(argv[i], "-a") == 0)
+      flags = (flags & ~O_TRUNC) | O_APPEND;
+    else if (strcmp(argv[i], "-i") != 0) /* the shell ignores SIGINT */
+      return pish_extern(argv, fds);
+  }
+
+  int *fv = malloc((sv_len(&argv[i]) + 1) * sizeof(int));
+  char *buf = malloc(PISH_COPY_BLOCK);
+
+  for (; argv[i]; i++) {
+    if ((fv[nf] = open(argv[i], flags, 0666)) < 0) {
+      fprintf(stderr, "tee: %s: %s\n", argv[i], strerror(errno));
+      status = 1;
+    } else
+      nf++;
+  }
+
+  pish_rbuf_flush(fds[0], fds[1]);
+
+  if (!nf) {
+    free(fv);
+    free(buf);
+    return (pish_copy(fds[0], fds[1]) < 0) || status;
+  }
+
+  /* between pipes, duplicate data to output, and then give it to a file */
+  if (nf == 1 && !pish_isvfd(fds[0]) && !pish_isvfd(fds[1]) &&
+      fstat(fds[0], &si) == 0 && fstat(fds[1], &so) == 0 &&
+      S_ISFIFO(si.st_mode) && S_ISFIFO(so.st_mode)) {
+    while ((n = tee(fds[0], fds[1], PISH_COPY_BLOCK, 0)) > 0 ||
+           (n < 0 && errno == EINTR)) {
+      if (n > 0 && pish_tee_give(fds[0], fv[0], n, buf) < 0)
+        break;
+    }
+  }
+
+  while (n != 0 && (n = pish_xread(fds[0], buf, PISH_COPY_BLOCK)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    if (pish_xwrite(fds[1], buf, n) < 0)
+      status = 1;
+
+    for (int k = 0; k < nf; k++)
+      pish_xwrite(fv[k], buf, n);
+  }
+
+  for (int k = 0; k < nf; k++)
+    close(fv[k]);
+
+  free(fv);
+  free(buf);
+  return status || n < 0;
+}
+
+/*
+ * filters read their input privately in large blocks, they never use
+ * read-ahead buffers of the shell, which are not for threads.
+ */
+
+/** count bytes @ch in @s of @len bytes, a word at a time */
+static size_t pish_count(const char *s, size_t len, char ch) {
+  const uint64_t lo7 = 0x7f7f7f7f7f7f7f7fULL;
+  const uint64_t pat = 0x0101010101010101ULL * (unsigned char)ch;
+  size_t n = 0;
+  size_t i = 0;
+
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+
+    memcpy(&w, s + i, 8);
+    w ^= pat; /* a zero byte for each match */
+    n += __builtin_popcountll(~(((w & lo7) + lo7) | w | lo7));
+  }
+
+  for (; i < len; i++)
+    n += (s[i] == ch);
+
+  return n;
+}
+
+/** output of a filter, written in large blocks */
+struct pish_obuf {
+  int fd;
+  size_t len;
+  char buf[PISH_RBUF_BLOCK];
+};
+
+static void pish_oflush(struct pish_obuf *o) {
+  if (o->len)
+    pish_xwrite(o->fd, o->buf, o->len);
+
+  o->len = 0;
+}
+
+static void pish_oput(struct pish_obuf *o, const char *s, size_t len) {
+  if (o->len + len > sizeof(o->buf))
+    pish_oflush(o);
+
+  if (len >= sizeof(o->buf))
+    pish_xwrite(o->fd, s, len);
+  else {
+    memcpy(o->buf + o->len, s, len);
+    o->len += len;
+  }
+}
+
+/** block reader of a filter, which keeps an incomplete last line */
+struct pish_lines {
+  int fd;
+  char *buf;
+  size_t cap;
+  size_t pos; /* unused data in [pos, len) */
+  size_t len;
+};
+
+/**
+ * read more data after the unused part, return bytes read, 0 at end.
+ * the buffer grows when a line does not fit in it.
+ */
+static ssize_t pish_lines_fill(struct pish_lines *ln) {
+  ssize_t n;
+
+  ln->len -= ln->pos;
+  memmove(ln->buf, ln->buf + ln->pos, ln->len);
+  ln->pos = 0;
+
+  if (ln->len == ln->cap)
+    ln->buf = realloc(ln->buf, ln->cap *= 2);
+
+  while ((n = pish_xread(ln->fd, ln->buf + ln->len, ln->cap - ln->len)) < 0 &&
+         errno == EINTR)
+    ;
+
+  if (n > 0)
+    ln->len += n;
+
+  return n;
+}
+
+/**
+ * start reading @ln with data the shell has read ahead from its fd,
+ * return its length, it is stored in @pend too.
+ */
+static size_t pish_lines_pending(struct pish_lines *ln, const char **pend) {
+  size_t len = pish_rbuf_pending(ln->fd, pend);
+
+  if (len > ln->cap)
+    ln->cap = len * 2;
+
+  ln->buf = malloc(ln->cap);
+
+  if (len)
+    memcpy(ln->buf, *pend, len);
+
+  ln->len = len;
+  return len;
+}
+
+/** open @name for a filter, NULL stands for input @fd */
+static int pish_filter_open(const char *cmd, const char *name, int fd) {
+  if (!name || strcmp(name, "-") == 0)
+    return fd;
+
+  if ((fd = open(name, O_RDONLY | O_CLOEXEC)) < 0)
+    fprintf(stderr, "%s: %s: %s\n", cmd, name, strerror(errno));
+
+  return fd;
+}
+
+/** read a count argument @s into @n, false if it is not one */
+static bool pish_filter_num(const char *s, long *n) {
+  char *end;
+
+  if (!s || !isdigit((unsigned char)*s))
+    return false;
+
+  *n = strtol(s, &end, 10);
+  return *end == '\0';
+}
+
+int pish_wc(char **argv, int fds[2]) {
+  bool lines = argv[1] && strcmp(argv[1], "-l") == 0;
+  size_t n = 0;
+  ssize_t k;
+  struct stat st;
+  const char *buf;
+
+  if ((!lines && (!argv[1] || strcmp(argv[1], "-c") != 0)) ||
+      (argv[2] && argv[3]))
+    return pish_extern(argv, fds);
+
+  int fd = pish_filter_open("wc", argv[2], fds[0]);
+
+  if (fd < 0)
+    return 1;
+
+  if ((k = pish_rbuf_pending(fd, &buf)) > 0)
+    n = lines ? pish_count(buf, k, '\n') : (size_t)k;
+
+  off_t at;
+
+  /* bytes of a regular file are known without reading them */
+  if (!lines && !pish_isvfd(fd) && fstat(fd, &st) == 0 &&
+      S_ISREG(st.st_mode) && (at = lseek(fd, 0, SEEK_CUR)) >= 0) {
+    n += (st.st_size > at) ? st.st_size - at : 0;
+    lseek(fd, 0, SEEK_END);
+  } else {
+    char *blk = malloc(PISH_COPY_BLOCK);
+
+    while ((k = pish_xread(fd, blk, PISH_COPY_BLOCK)) > 0 ||
+           (k < 0 && errno == EINTR))
+      if (k > 0)
+        n += lines ? pish_count(blk, k, '\n') : (size_t)k;
+
+    free(blk);
+  }
+
+  if (argv[2])
+    pish_xprintf(fds[1], "%zu %s\n", n, argv[2]);
+  else
+    pish_xprintf(fds[1], "%zu\n", n);
+
+  if (fd != fds[0])
+    close(fd);
+
+  return 0;
+}
+
+int pish_head(char **argv, int fds[2]) {
+  long n = 10;
+  bool bytes = false;
+  int i = 1;
+
+  for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+    const char *v = NULL;
+
+    if (strcmp(argv[i], "--") == 0) {
+      i++;
+      break;
+    }
+
+    if (argv[i][1] == 'n' || argv[i][1] == 'c') {
+      bytes = (argv[i][1] == 'c');
+      v = argv[i][2] ? &argv[i][2] : argv[++i];
+    } else
+      v = &argv[i][1]; /* head -N */
+
+    if (!pish_filter_num(v, &n))
+      return pish_extern(argv, fds);
+  }
+
+  if (argv[i] && argv[i + 1])
+    return pish_extern(argv, fds);
+
+  int fd = pish_filter_open("head", argv[i], fds[0]);
+
+  if (fd < 0)
+    return 1;
+
+  struct pish_lines ln = {fd, NULL, PISH_COPY_BLOCK, 0, 0};
+  const char *pend;
+  size_t plen = pish_lines_pending(&ln, &pend);
+
+  /* a block is printed up to where it finishes counting */
+  while (n > 0 && (ln.pos < ln.len || pish_lines_fill(&ln) > 0)) {
+    const char *buf = ln.buf + ln.pos;
+    size_t k = ln.len - ln.pos;
+    size_t end = k;
+
+    if (bytes) {
+      end = ((size_t)n < k) ? (size_t)n : k;
+      n -= end;
+    } else {
+      const char *p = buf;
+
+      while (n > 0 && (p = memchr(p, '\n', buf + k - p))) {
+        n--;
+        p++;
+      }
+
+      if (!n)
+        end = p - buf;
+    }
+
+    pish_xwrite(fds[1], buf, end);
+    ln.pos += end;
+  }
+
+  /* leave the rest of a regular file for whoever reads it next */
+  if (!plen && !pish_isvfd(fd) && ln.pos < ln.len)
+    lseek(fd, -(off_t)(ln.len - ln.pos), SEEK_CUR);
+
+  if (fd != fds[0])
+    close(fd);
+
+  free(ln.buf);
+  return 0;
+}
+
+/** bytes which make a pattern more than a fixed string */
+#define PISH_GREP_META ".[]*^$\\"
+
+/** add patterns in lines of @s to @pv */
+static char **pish_grep_pat(char **pv, int *n, int *max, const char *s) {
+  const char *nl;
+
+  for (; (nl = strchr(s, '\n')); s = nl + 1)
+    pv = sv_push(pv, n, max, strsub(s, nl - s));
+
+  return sv_push(pv, n, max, strclo(s));
+}
+
+/** find the first match of any pattern @pv in @s of @len bytes */
+static const char *pish_grep_find(char **pv, const char *s, size_t len) {
+  const char *hit = NULL;
+
+  for (; *pv; pv++) {
+    size_t plen = strlen(*pv);
+    size_t lim = hit ? (size_t)(hit - s) + plen : len; /* only earlier ones */
+    const char *p = memmem(s, (lim < len) ? lim : len, *pv, plen);
+
+    if (p && (!hit || p < hit))
+      hit = p;
+  }
+
+  return hit;
+}
+
+int pish_grep(char **argv, int fds[2]) {
+  bool fixed = false, inv = false, count = false, quiet = false;
+  char **pv = NULL;
+  int pn = 0, pmax = 0;
+  int i = 1;
+
+  for (; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+    if (strcmp(argv[i], "--") == 0) {
+      i++;
+      break;
+    }
+
+    for (char *o = &argv[i][1]; *o; o++) {
+      if (*o == 'e' && (o[1] || argv[i + 1])) {
+        pv = pish_grep_pat(pv, &pn, &pmax, o[1] ? o + 1 : argv[++i]);
+        break;
+      }
+
+      if (*o == 'F')
+        fixed = true;
+      else if (*o == 'v')
+        inv = true;
+      else if (*o == 'c')
+        count = true;
+      else if (*o == 'q')
+        quiet = true;
+      else {
+        sv_free(pv);
+        return pish_extern(argv, fds);
+      }
+    }
+  }
+
+  if (!pv && argv[i])
+    pv = pish_grep_pat(pv, &pn, &pmax, argv[i++]);
+
+  bool plain = pv && !(argv[i] && argv[i + 1]);
+
+  for (int k = 0; plain && k < pn; k++)
+    if (!fixed && pv[k][strcspn(pv[k], PISH_GREP_META)])
+      plain = false;
+
+  if (!plain) {
+    sv_free(pv);
+    return pish_extern(argv, fds);
+  }
+
+  int fd = pish_filter_open("grep", argv[i], fds[0]);
+
+  if (fd < 0) {
+    sv_free(pv);
+    return 2;
+  }
+
+  struct pish_lines ln = {fd, NULL, PISH_COPY_BLOCK, 0, 0};
+  struct pish_obuf *o = malloc(sizeof(struct pish_obuf));
+  const char *pend;
+  long hits = 0;
+  bool eof = false;
+
+  o->fd = fds[1];
+  o->len = 0;
+  pish_lines_pending(&ln, &pend);
+
+  while (!eof && !(quiet && hits)) {
+    eof = pish_lines_fill(&ln) <= 0;
+
+    /* complete lines, and at end of input the last one too */
+    const char *s = ln.buf;
+    const char *end = ln.buf + ln.len;
+
+    if (!eof) {
+      const char *nl = memrchr(ln.buf, '\n', ln.len);
+
+      end = nl ? nl + 1 : ln.buf;
+    }
+
+    while (s < end) {
+      const char *hit = pish_grep_find(pv, s, end - s);
+      const char *ls = hit ? memrchr(s, '\n', hit - s) : NULL;
+
+      ls = hit ? (ls ? ls + 1 : s) : end;
+
+      if (inv && ls > s) { /* lines before the match are selected */
+        hits += pish_count(s, ls - s, '\n') +
+                (ls == end && eof && end[-1] != '\n');
+
+        if (!count && !quiet) {
+          pish_oput(o, s, ls - s);
+
+          if (ls == end && eof && end[-1] != '\n')
+            pish_oput(o, "\n", 1);
+        }
+      }
+
+      if (!hit)
+        break;
+
+      const char *le = memchr(hit, '\n', end - hit);
+
+      le = le ? le + 1 : end;
+
+      if (!inv) {
+        hits++;
+
+        if (!count && !quiet) {
+          pish_oput(o, ls, le - ls);
+
+          if (le[-1] != '\n')
+            pish_oput(o, "\n", 1);
+        }
+      }
+
+      if (quiet && hits)
+        break;
+
+      s = le;
+    }
+
+    ln.pos = end - ln.buf;
+  }
+
+  if (count)
+    pish_xprintf(fds[1], "%ld\n", hits);
+
+  pish_oflush(o);
+
+  if (fd != fds[0])
+    close(fd);
+
+  free(o);
+  free(ln.buf);
+  sv_free(pv);
+  return hits ? 0 : 1;
+}
+
+/** bytes left for arguments of exec, after environment */
+static long pish_arg_max(void) {
+  long max = sysconf(_SC_ARG_MAX);
+
+  if (max <= 0)
+    max = 128 * 1024;
+
+  for (char **e = environ; *e; e++)
+    max -= strlen(*e) + 1 + sizeof(char *);
+
+  return max - 2048; /* headroom, as POSIX suggests */
+}
+
+/** bytes argument @s takes in exec */
+static long pish_arg_size(const char *s) {
+  return strlen(s) + 1 + sizeof(char *);
+}
+
+/** test if @argv is too long for exec */
+static bool pish_arg_over(char **argv) {
+  long size = sizeof(char *);
+
+  for (char **a = argv; *a; a++)
+    size += pish_arg_size(*a);
+
+  return size > pish_arg_max();
+}
+
+/** count @argv[0] and its leading options, which are kept in each batch */
+static int pish_arg_keep(char **argv) {
+  int keep = 1;
+
+  while (argv[keep] && argv[keep][0] == '-' && argv[keep][1] != '\0') {
+    if (strcmp(argv[keep++], "--") == 0)
+      break;
+  }
+
+  return keep;
+}
+
+/**
+ * run external @argv in batches which fit in exec, the first @keep
+ * arguments are repeated in each batch and the rest are split, like
+ * xargs does. at most @jobs batches run at once.
+ * return 0 if all batches succeed, otherwise status of the last failed one.
+ */
+static int pish_batch_run(char **argv, int keep, int jobs, int fds[2]) {
+  int argc = sv_len(argv);
+  long max = pish_arg_max();
+  long base = sizeof(char *);
+  char **v = malloc((argc + 1) * sizeof(char *));
+  pid_t *pids = calloc(jobs, sizeof(pid_t));
+  int status = 0;
+  int slot = 0;
+  int i = keep;
+
+  for (int j = 0; j < keep; j++) {
+    base += pish_arg_size(argv[j]);
+    v[j] = argv[j];
+  }
+
+  do {
+    int j = keep;
+    long size = base;
+
+    /* take as many arguments as fit, and at least one */
+    while (i < argc &&
+           (j == keep || size + pish_arg_size(argv[i]) <= max)) {
+      size += pish_arg_size(argv[i]);
+      v[j++] = argv[i++];
+    }
+
+    v[j] = NULL;
+
+    if (pids[slot] > 0 && (j = pish_wait(pids[slot])) != 0)
+      status = j;
+
+    /* a vfork child has exec'd when it returns, so v can be reused */
+    if ((pids[slot] = pish_fork(v, fds)) < 0) {
+      fprintf(stderr, "failed to fork %s, errno = %d.\n", argv[0], errno);
+      status = -1;
+      break;
+    }
+
+    slot = (slot + 1) % jobs;
+  } while (i < argc);
+
+  for (int k = 0; k < jobs; k++) {
+    int st;
+
+    if (pids[k] > 0 && (st = pish_wait(pids[k])) != 0)
+      status = st;
+  }
+
+  free(pids);
+  free(v);
+  return status;
+}
+
+/** run @argv in batches with defaults of autosplit */
+static int pish_autobatch(char **argv, int fds[2]) {
+  return pish_batch_run(argv, pish_arg_keep(argv), 1, fds);
+}
+
+/** fork a child running @fn on @argv, return its pid */
+static pid_t pish_spawn(int (*fn)(char **, int[2]), char **argv,
+                        int fds[2]) {
+  pish_rbuf_give();
+
+  pid_t pid = fork();
+
+  if (pid == 0) {
+    signal(SIGPIPE, SIG_DFL);
+
+    if (pish_sched_next && !pish_sched_apply(pish_sched_next))
+      _exit(126);
+
+    _exit(fn(argv, fds) & 0xff);
+  }
+
+  return pid;
+}
+
+static int pish_call(struct pish_node *body, char **argv, int fds[2]);
+
+/**
+ * execute @argv, if it is started with a function or a builtin cmd,
+ * run it directly and return its status, otherwise start it with
+ * pish_fork(), the child is stored in @pid and should be waited by caller.
+ * commands too long for exec under autosplit run in a child as well.
+ */
+int pish_exec(char **argv, int fds[2], pid_t *pid) {
+  struct pish_node *fn = ht_get(&pish_funcs, argv[0]);
+  struct pish_cmd_desc *desc;
+
+  *pid = 0;
+
+  if (fn)
+    return pish_call(fn, argv, fds);
+
+  if ((desc = pish_builtin(argv[0]))) {
+    if (pish_rbuf_shared && fds[0] == pish_rbuf_shared->fd)
+      pish_rbuf_give(); /* it may read the script */
+
+    return desc->exec(argv, fds);
+  }
+
+  if (pish_autosplit && pish_arg_over(argv))
+    *pid = pish_spawn(pish_autobatch, argv, fds);
+  else
+    *pid = pish_fork(argv, fds);
+
+  if (*pid < 0) {
+    fprintf(stderr, "failed to fork %s, errno = %d.\n", argv[0], errno);
+    *pid = 0;
+    return -1;
+  }
+
+  return 0;
+}
+
+/** a coprocess, its output is read from fds[0], its input is fds[1] */
+struct pish_coproc {
+  pid_t pid;
+  int fds[2];
+};
+
+/* coprocesses by name */
+static struct ht pish_coprocs;
+
+/**
+ * close pipes of coprocess @cp and wait for it, return its status.
+ * its input is closed first, and output it writes after that is read
+ * and dropped, so a filter sees end of input and leaves, not EPIPE.
+ */
+static int pish_coproc_end(struct pish_coproc *cp) {
+  if (!cp)
+    return 0;
+
+  char buf[4096];
+  ssize_t n;
+
+  close(cp->fds[1]);
+
+  while ((n = read(cp->fds[0], buf, sizeof(buf))) > 0 ||
+         (n < 0 && errno == EINTR))
+    ;
+
+  close(cp->fds[0]);
+
+  int status = pish_wait(cp->pid);
+
+  free(cp);
+  return status;
+}
+
+int pish_coproc(char **argv, __unused int fds[2]) {
+  struct pish_coproc *cp;
+  int in[2];
+  int out[2];
+  char *pid;
+
+  if (argv[1] && strcmp(argv[1], "-w") == 0 && argv[2]) {
+    if (!(cp = ht_del(&pish_coprocs, argv[2]))) {
+      fprintf(stderr, "coproc: no coprocess %s\n", argv[2]);
+      return 1;
+    }
+
+    pish_array_free(ht_del(&pish_arrays, argv[2]));
+    asprintf(&pid, "%s_PID", argv[2]);
+    unsetenv(pid);
+    free(pid);
+    return pish_coproc_end(cp);
+  }
+
+  if (!argv[1] || !argv[2]) {
+    fprintf(stderr, "coproc: usage: coproc NAME CMD [ARGS] | -w NAME\n");
+    return 1;
+  }
+
+  pish_coproc_end(ht_del(&pish_coprocs, argv[1]));
+
+  /* the ends kept by shell are close-on-exec, not to leak into others */
+  pipe2(in, O_CLOEXEC);
+  pipe2(out, O_CLOEXEC);
+  cp = calloc(1, sizeof(struct pish_coproc));
+  cp->fds[0] = out[0];
+  cp->fds[1] = in[1];
+
+  if (ht_get(&pish_funcs, argv[2]) || pish_builtin(argv[2])) {
+    if ((cp->pid = fork()) == 0) {
+      pid_t p;
+
+      close(out[0]);
+      close(in[1]);
+
+      int status = pish_exec(&argv[2], (int[2]){in[0], out[1]}, &p);
+
+      _exit((p ? pish_wait(p) : status) & 0xff);
+    }
+  } else
+    pish_exec(&argv[2], (int[2]){in[0], out[1]}, &cp->pid);
+
+  close(in[0]);
+  close(out[1]);
+
+  if (cp->pid <= 0) {
+    cp->pid = -1;
+    pish_coproc_end(cp);
+    return 1;
+  }
+
+  struct pish_array *a = pish_array_new(argv[1]);
+
+  for (int i = 0; i < 2; i++) {
+    asprintf(&pid, "%d", cp->fds[i]);
+    pish_array_push(a, pid);
+  }
+
+  char val[12];
+
+  snprintf(val, sizeof(val), "%d", cp->pid);
+  asprintf(&pid, "%s_PID", argv[1]);
+  setenv(pid, val, 1);
+  free(pid);
+  ht_put(&pish_coprocs, argv[1], cp);
+  return 0;
+}
+
+int pish_batch(char **argv, int fds[2]) {
+  int jobs = 1;
+  int keep = -1;
+  pid_t pid;
+  int status;
+
+  for (argv++; *argv && (*argv)[0] == '-' && argv[1]; argv += 2) {
+    if (strcmp(*argv, "-P") == 0)
+      jobs = atoi(argv[1]);
+    else if (strcmp(*argv, "-k") == 0)
+      keep = atoi(argv[1]);
+    else
+      break;
+  }
+
+  if (*argv == NULL)
+    return 0;
+
+  if (jobs <= 0)
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+  /* functions and builtins take any number of arguments */
+  if (ht_get(&pish_funcs, argv[0]) || pish_builtin(argv[0])) {
+    status = pish_exec(argv, fds, &pid);
+    return pid ? pish_wait(pid) : status;
+  }
+
+  if (keep < 0)
+    keep = pish_arg_keep(argv);
+  else if (++keep > sv_len(argv))
+    keep = sv_len(argv);
+
+  return pish_batch_run(argv, keep, jobs > 0 ? jobs : 1, fds);
+}
+
+/** ops of a compiled glob pattern */
+enum pish_gop_type {
+  PISH_G_LIT,  /* literal run */
+  PISH_G_ANY,  /* ? */
+  PISH_G_STAR, /* * */
+  PISH_G_SET,  /* [...] */
+};
+
+struct pish_gop {
+  enum pish_gop_type type;
+  int len;
+  char *lit;
+  unsigned char set[32]; /* bitmap of a character class */
+};
+
+/** a path component of glob pattern, compiled into ops */
+struct pish_pat {
+  char *src;
+  int n;
+  struct pish_gop *ops;
+};
+
+static struct pish_gop *pish_pat_op(struct pish_pat *pt, int type) {
+  pt->ops = realloc(pt->ops, (pt->n + 1) * sizeof(struct pish_gop));
+  memset(&pt->ops[pt->n], 0, sizeof(struct pish_gop));
+  pt->ops[pt->n].type = type;
+  return &pt->ops[pt->n++];
+}
+
+/**
+ * compile character class [...] started at @s into bitmap @set,
+ * return position after it, or NULL if it is not closed.
+ */
+static const char *pish_pat_set(const char *s, unsigned char set[32]) {
+  bool neg = (s[1] == '!' || s[1] == '^');
+  const unsigned char *c = (const unsigned char *)s + 1 + neg;
+  const unsigned char *e;
+
+  /* the first character is always a member, so []] works */
+  if (*c == '\0' || !(e = (const unsigned char *)strchr((char *)c + 1, ']')))
+    return NULL;
+
+  memset(set, 0, 32);
+
+  for (; c < e; c++) {
+    int lo = *c;
+    int hi = *c;
+
+    if (c[1] == '-' && c + 2 < e) {
+      hi = c[2];
+      c += 2;
+    }
+
+    for (int ch = lo; ch <= hi; ch++)
+      set[ch / 8] |= 1 << (ch % 8);
+  }
+
+  if (neg)
+    for (int i = 0; i < 32; i++)
+      set[i] = ~set[i];
+
+  return (const char *)e + 1;
+}
+
+/** compile pattern @s, a path component, into @pt */
+void pish_pat_compile(struct pish_pat *pt, const char *s) {
+  unsigned char set[32];
+
+  pt->src = strclo(s);
+  pt->n = 0;
+  pt->ops = NULL;
+
+  while (*s) {
+    const char *e;
+
+    if (*s == '*') {
+      while (*s == '*')
+        s++;
+      pish_pat_op(pt, PISH_G_STAR);
+    } else if (*s == '?') {
+      s++;
+      pish_pat_op(pt, PISH_G_ANY);
+    } else if (*s == '[' && (e = pish_pat_set(s, set))) {
+      memcpy(pish_pat_op(pt, PISH_G_SET)->set, set, sizeof(set));
+      s = e;
+    } else { /* a literal run, a [ without ] is literal as well */
+      e = s + 1 + strcspn(s + 1, "*?[");
+
+      struct pish_gop *op = pish_pat_op(pt, PISH_G_LIT);
+
+      op->len = e - s;
+      op->lit = strsub(s, op->len);
+      s = e;
+    }
+  }
+}
+
+void pish_pat_free(struct pish_pat *pt) {
+  for (int i = 0; i < pt->n; i++)
+    free(pt->ops[i].lit);
+
+  free(pt->ops);
+  free(pt->src);
+}
+
+/**
+ * match name @s against compiled pattern @pt,
+ * a star takes as few characters as it can, and on a mismatch
+ * the last star takes more, skipping to where the next literal is.
+ */
+bool pish_pat_match(struct pish_pat *pt, const char *s) {
+  int i = 0;
+  int si = -1; /* the last star */
+  const char *sp = NULL;
+
+  /* a leading dot must be matched literally */
+  if (*s == '.' && (!pt->n || pt->ops[0].type != PISH_G_LIT ||
+                    pt->ops[0].lit[0] != '.'))
+    return false;
+
+  while (true) {
+    if (i < pt->n) {
+      struct pish_gop *op = &pt->ops[i];
+      unsigned char c = *s;
+
+      switch (op->type) {
+      case PISH_G_STAR:
+        if (i + 1 == pt->n)
+          return true;
+        si = i++;
+        sp = s;
+        continue;
+      case PISH_G_LIT:
+        if (strncmp(s, op->lit, op->len) == 0) {
+          s += op->len;
+          i++;
+          continue;
+        }
+        break;
+      case PISH_G_ANY:
+        if (c) {
+          s++;
+          i++;
+          continue;
+        }
+        break;
+      case PISH_G_SET:
+        if (c && (op->set[c / 8] & (1 << (c % 8)))) {
+          s++;
+          i++;
+          continue;
+        }
+        break;
+      }
+    } else if (*s == '\0')
+      return true;
+
+    if (si < 0 || *sp == '\0')
+      return false;
+
+    s = ++sp;
+    i = si + 1;
+
+    if (pt->ops[i].type == PISH_G_LIT) {
+      if (!(s = strstr(sp, pt->ops[i].lit)))
+        return false;
+      sp = s;
+    }
+  }
+}
+
+#define PISH_GLOB_BUF (256 * 1024)
+
+/** state of expanding a glob pattern */
+struct pish_glob {
+  int nc; /* number of path components */
+  struct pish_pat *pats;
+  bool dironly; /* pattern ends with '/' */
+  bool nested;  /* running in a walker of ** */
+  char *dbuf;   /* getdents64 buffer */
+  char path[PATH_MAX];
+  char ***argv; /* matches are appended to it */
+  int *n;
+  int *max;
+};
+
+/** test if @name in directory @dfd is a directory, using @type if known */
+static bool pish_isdir(int dfd, const char *name, int type) {
+  struct stat st;
+
+  if (type != DT_UNKNOWN && type != DT_LNK)
+    return type == DT_DIR;
+
+  return fstatat(dfd, name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+}
+
+/** append @name after path of @len characters, return new length */
+static size_t pish_glob_path(struct pish_glob *g, size_t len, const char *name,
+                             bool slash) {
+  size_t n = strlen(name);
+
+  if (len + n + 2 > sizeof(g->path))
+    return 0;
+
+  memcpy(g->path + len, name, n);
+  len += n;
+
+  if (slash)
+    g->path[len++] = '/';
+
+  g->path[len] = '\0';
+  return len;
+}
+
+static void pish_glob_tree(struct pish_glob *g, int dfd, size_t len, int i);
+
+/**
+ * match component @i of pattern in directory @dfd, whose path
+ * of @len characters is in @g->path. @dfd is closed when done.
+ * directory is read with getdents64 into a large buffer, and d_type
+ * tells directories, so no entry is stat'ed unless it is a link.
+ */
+static void pish_glob_dir(struct pish_glob *g, int dfd, size_t len, int i) {
+  struct pish_pat *pt = &g->pats[i];
+  bool last = (i + 1 == g->nc);
+  char **names = NULL; /* matched directories to descend into */
+  int nn = 0;
+  int max = 0;
+
+  if (strcmp(pt->src, "**") == 0) {
+    pish_glob_tree(g, dfd, len, i);
+    return;
+  }
+
+  if (pt->n == 1 && pt->ops[0].type == PISH_G_LIT) { /* no need to scan */
+    names = sv_push(names, &nn, &max, strclo(pt->src));
+
+    if (last && faccessat(dfd, pt->src, F_OK, AT_SYMLINK_NOFOLLOW) < 0)
+      nn = 0;
+  } else {
+    ssize_t got;
+
+    while ((got = getdents64(dfd, g->dbuf, PISH_GLOB_BUF)) > 0) {
+      for (char *p = g->dbuf; p < g->dbuf + got;) {
+        struct dirent64 *d = (struct dirent64 *)p;
+
+        p += d->d_reclen;
+
+        if (d->d_name[0] == '.' &&
+            (d->d_name[1] == '\0' ||
+             (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+          continue;
+
+        if (!pish_pat_match(pt, d->d_name))
+          continue;
+
+        if ((!last || g->dironly) && !pish_isdir(dfd, d->d_name, d->d_type))
+          continue;
+
+        if (!last)
+          names = sv_push(names, &nn, &max, strclo(d->d_name));
+        else if (pish_glob_path(g, len, d->d_name, g->dironly))
+          *g->argv = sv_push(*g->argv, g->n, g->max, strclo(g->path));
+      }
+    }
+
+    if (last) {
+      close(dfd);
+      return;
+    }
+  }
+
+  for (int k = 0; k < nn; k++) {
+    size_t nlen = pish_glob_path(g, len, names[k], !last || g->dironly);
+
+    if (!nlen)
+      continue;
+
+    if (last)
+      *g->argv = sv_push(*g->argv, g->n, g->max, strclo(g->path));
+    else {
+      int fd = openat(dfd, names[k], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+      if (fd >= 0)
+        pish_glob_dir(g, fd, nlen, i + 1);
+    }
+  }
+
+  sv_free(names);
+  close(dfd);
+}
+
+/** a directory to walk for ** */
+struct pish_walk_task {
+  char *path; /* with a trailing '/', "" for current directory */
+  size_t len;
+  int fd; /* already opened, or -1 */
+};
+
+/**
+ * tasks of a walker, the owner pushes and pops at tail,
+ * idle walkers steal from head, where the larger subtrees are.
+ */
+struct pish_walk_deque {
+  pthread_mutex_t lock;
+  struct pish_walk_task **v;
+  int head;
+  int tail;
+  int cap;
+};
+
+/** a parallel walk of a subtree for a ** component */
+struct pish_walk {
+  struct pish_glob *g;
+  int i;  /* index of ** component */
+  int nw; /* number of walkers */
+  struct pish_walk_deque *dq;
+  atomic_int pending; /* tasks queued or running */
+  atomic_int queued;  /* tasks queued */
+  atomic_int idle;    /* walkers parked on @cond for a task */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+/** a walker thread, matches are collected in its own vector */
+struct pish_walker {
+  struct pish_walk *w;
+  int id;
+  pthread_t tid;
+  struct pish_glob g;
+  char **res;
+  int n;
+  int max;
+};
+
+#define PISH_WALK_MAX 8
+
+static void pish_walk_push(struct pish_walk *w, int id, char *path,
+                           size_t len) {
+  struct pish_walk_deque *dq = &w->dq[id];
+  struct pish_walk_task *t = malloc(sizeof(struct pish_walk_task));
+
+  t->path = path;
+  t->len = len;
+  t->fd = -1;
+  atomic_fetch_add(&w->pending, 1);
+  pthread_mutex_lock(&dq->lock);
+
+  if (dq->tail == dq->cap) {
+    if (dq->head > 0) {
+      memmove(dq->v, &dq->v[dq->head], (dq->tail - dq->head) * sizeof(t));
+      dq->tail -= dq->head;
+      dq->head = 0;
+    } else {
+      dq->cap = dq->cap ? dq->cap * 2 : 64;
+      dq->v = realloc(dq->v, dq->cap * sizeof(t));
+    }
+  }
+
+  dq->v[dq->tail++] = t;
+  pthread_mutex_unlock(&dq->lock);
+  atomic_fetch_add(&w->queued, 1);
+
+  if (atomic_load(&w->idle) > 0) { /* wake one parked to steal it */
+    pthread_mutex_lock(&w->lock);
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+  }
+}
+
+/** take a task from tail of own deque, or steal from head of another */
+static struct pish_walk_task *pish_walk_take(struct pish_walk *w, int id) {
+  struct pish_walk_task *t = NULL;
+
+  for (int k = 0; k < w->nw && !t; k++) {
+    struct pish_walk_deque *dq = &w->dq[(id + k) % w->nw];
+
+    pthread_mutex_lock(&dq->lock);
+
+    if (dq->head < dq->tail)
+      t = (k == 0) ? dq->v[--dq->tail] : dq->v[dq->head++];
+
+    if (dq->head == dq->tail)
+      dq->head = dq->tail = 0;
+
+    pthread_mutex_unlock(&dq->lock);
+  }
+
+  if (t)
+    atomic_fetch_sub(&w->queued, 1);
+
+  return t;
+}
+
+/**
+ * scan a directory of the subtree: queue its subdirectories, and match
+ * the rest of pattern here. a single component left is matched during
+ * the same scan, otherwise the rest is globbed from this directory.
+ */
+static void pish_walk_dir(struct pish_walker *wk, struct pish_walk_task *t) {
+  struct pish_glob *g = &wk->g;
+  int i = wk->w->i;
+  bool tail = (i + 1 == g->nc); /* ** is the last component */
+  bool one = (i + 2 == g->nc);  /* a single component follows */
+  int fd = t->fd;
+  ssize_t got;
+
+  if (fd < 0)
+    fd = open(*t->path ? t->path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  if (fd < 0)
+    return;
+
+  memcpy(g->path, t->path, t->len + 1);
+
+  while ((got = getdents64(fd, g->dbuf, PISH_GLOB_BUF)) > 0) {
+    for (char *p = g->dbuf; p < g->dbuf + got;) {
+      struct dirent64 *d = (struct dirent64 *)p;
+      struct stat st;
+      bool dir = (d->d_type == DT_DIR);
+
+      p += d->d_reclen;
+
+      if (d->d_name[0] == '.' &&
+          (d->d_name[1] == '\0' ||
+           (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+        continue;
+
+      if (d->d_type == DT_UNKNOWN) /* links are never followed */
+        dir = fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+              S_ISDIR(st.st_mode);
+
+      if (dir && d->d_name[0] != '.') {
+        size_t len = pish_glob_path(g, t->len, d->d_name, true);
+
+        if (len)
+          pish_walk_push(wk->w, wk->id, strsub(g->path, len), len);
+      }
+
+      if (tail ? d->d_name[0] == '.'
+               : !one || !pish_pat_match(&g->pats[i + 1], d->d_name))
+        continue;
+
+      if (g->dironly && !pish_isdir(fd, d->d_name, d->d_type))
+        continue;
+
+      if (pish_glob_path(g, t->len, d->d_name, g->dironly))
+        wk->res = sv_push(wk->res, &wk->n, &wk->max, strclo(g->path));
+    }
+  }
+
+  if (!tail && !one && lseek(fd, 0, SEEK_SET) == 0)
+    pish_glob_dir(g, fd, t->len, i + 1); /* it closes fd */
+  else
+    close(fd);
+}
+
+static void *pish_walker_run(void *arg) {
+  struct pish_walker *wk = arg;
+  struct pish_walk *w = wk->w;
+
+  while (true) {
+    struct pish_walk_task *t = pish_walk_take(w, wk->id);
+
+    if (t) {
+      pish_walk_dir(wk, t);
+      free(t->path);
+      free(t);
+
+      if (atomic_fetch_sub(&w->pending, 1) == 1) { /* the walk is done */
+        pthread_mutex_lock(&w->lock);
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+      }
+
+      continue;
+    }
+
+    if (atomic_load(&w->pending) == 0)
+      break;
+
+    /* park until a task is queued, or the last one is done */
+    pthread_mutex_lock(&w->lock);
+    atomic_fetch_add(&w->idle, 1);
+
+    while (atomic_load(&w->queued) == 0 && atomic_load(&w->pending) > 0)
+      pthread_cond_wait(&w->cond, &w->lock);
+
+    atomic_fetch_sub(&w->idle, 1);
+    pthread_mutex_unlock(&w->lock);
+  }
+
+  return NULL;
+}
+
+/**
+ * match ** component @i and the rest of pattern in the subtree of @dfd,
+ * the walk is spread over a small work-stealing pool of threads, each
+ * scanning its own directories, and their matches are merged at last.
+ * a walk nested in another one runs in the calling thread.
+ */
+static void pish_glob_tree(struct pish_glob *g, int dfd, size_t len, int i) {
+  struct pish_walk w = {.g = g, .i = i, .nw = 1};
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (!g->nested && ncpu > 1)
+    w.nw = (ncpu < PISH_WALK_MAX) ? ncpu : PISH_WALK_MAX;
+
+  struct pish_walker *wk = calloc(w.nw, sizeof(struct pish_walker));
+
+  w.dq = calloc(w.nw, sizeof(struct pish_walk_deque));
+  atomic_init(&w.pending, 0);
+  atomic_init(&w.queued, 0);
+  atomic_init(&w.idle, 0);
+  pthread_mutex_init(&w.lock, NULL);
+  pthread_cond_init(&w.cond, NULL);
+
+  for (int k = 0; k < w.nw; k++) {
+    pthread_mutex_init(&w.dq[k].lock, NULL);
+    wk[k].w = &w;
+    wk[k].id = k;
+    wk[k].g = *g;
+    wk[k].g.nested = true;
+    wk[k].g.dbuf = malloc(PISH_GLOB_BUF);
+    wk[k].g.argv = &wk[k].res;
+    wk[k].g.n = &wk[k].n;
+    wk[k].g.max = &wk[k].max;
+  }
+
+  if (i + 1 == g->nc && len > 0) /* a trailing ** matches base as well */
+    *g->argv = sv_push(*g->argv, g->n, g->max, strsub(g->path, len));
+
+  pish_walk_push(&w, 0, strsub(g->path, len), len);
+  w.dq[0].v[0]->fd = dfd;
+
+  int started = 1; /* walkers failed to start leave their deques empty */
+
+  while (started < w.nw &&
+         pthread_create(&wk[started].tid, NULL, pish_walker_run,
+                        &wk[started]) == 0)
+    started++;
+
+  pish_walker_run(&wk[0]);
+
+  for (int k = 1; k < started; k++)
+    pthread_join(wk[k].tid, NULL);
+
+  for (int k = 0; k < w.nw; k++) {
+    for (int j = 0; j < wk[k].n; j++)
+      *g->argv = sv_push(*g->argv, g->n, g->max, wk[k].res[j]);
+
+    free(wk[k].res);
+    free(wk[k].g.dbuf);
+    free(w.dq[k].v);
+    pthread_mutex_destroy(&w.dq[k].lock);
+  }
+
+  pthread_mutex_destroy(&w.lock);
+  pthread_cond_destroy(&w.cond);
+  free(w.dq);
+  free(wk);
+}
+
+static int pish_strcmp(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * expand glob pattern @pat, append sorted matches to string vector
+ * @*argv holding @*n strings with room for @*max.
+ * return number of matches.
+ */
+int pish_glob(const char *pat, char ***argv, int *n, int *max) {
+  struct pish_glob g = {.argv = argv, .n = n, .max = max};
+  char *buf = strclo(pat);
+  char *save;
+  int start = *n;
+  int dfd = open(*pat == '/' ? "/" : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  for (char *c = strtok_r(buf, "/", &save); c; c = strtok_r(NULL, "/", &save)) {
+    if (g.nc > 0 && strcmp(c, "**") == 0 &&
+        strcmp(g.pats[g.nc - 1].src, c) == 0)
+      continue; /* consecutive ** are the same as one */
+
+    g.pats = realloc(g.pats, (g.nc + 1) * sizeof(struct pish_pat));
+    pish_pat_compile(&g.pats[g.nc++], c);
+  }
+
+  g.dironly = (pat[strlen(pat) - 1] == '/');
+  strcpy(g.path, (*pat == '/') ? "/" : "");
+
+  if (g.nc > 0 && dfd >= 0) {
+    g.dbuf = malloc(PISH_GLOB_BUF);
+    pish_glob_dir(&g, dfd, strlen(g.path), 0);
+    free(g.dbuf);
+  } else if (dfd >= 0)
+    close(dfd);
+
+  for (int i = 0; i < g.nc; i++)
+    pish_pat_free(&g.pats[i]);
+
+  free(g.pats);
+  free(buf);
+  qsort(&(*argv)[start], *n - start, sizeof(char *), pish_strcmp);
+  return *n - start;
+}
+
+/** push field @s into @argv, or its matches if it is a glob pattern */
+static char **pish_push_field(char **argv, int *n, int *max, char *s,
+                              bool glob) {
+  if (glob && strpbrk(s, "*?[") && pish_glob(s, &argv, n, max) > 0) {
+    free(s);
+    return argv;
+  }
+
+  return sv_push(argv, n, max, s);
+}
+
+/**
+ * generate words of brace expansion @w into @argv.
+ * argv grows once to hold the whole product, and words without quotes,
+ * substitutions or glob characters are generated right into it.
+ */
+static char **pish_push_brace(char **argv, int *n, int *max,
+                              struct pish_word *w) {
+  struct pish_brace *b = w->brace;
+  char **v;
+
+  if (*n + b->count + 1 > *max) {
+    *max = *n + b->count + 1;
+    argv = realloc(argv, *max * sizeof(char *));
+  }
+
+  if (!strpbrk(w->raw, "\"$") && !w->glob) {
+    v = &argv[*n];
+    pish_brace_gen(b, v);
+
+    for (long k = 0; k < b->count; k++) {
+      if (*v[k])
+        argv[(*n)++] = v[k];
+      else
+        free(v[k]);
+    }
+
+    argv[*n] = NULL;
+    return argv;
+  }
+
+  v = malloc(b->count * sizeof(char *));
+  pish_brace_gen(b, v);
+
+  for (long k = 0; k < b->count; k++) {
+    char *s = strchr(v[k], '$') ? pish_expand(v[k]) : strclo(v[k]);
+    char **fv = pish_fold(s, PISH_IFS, false);
+
+    for (char **f = fv; f && *f; f++)
+      argv = pish_push_field(argv, n, max, *f, w->glob);
+
+    free(fv);
+    free(s);
+    free(v[k]);
+  }
+
+  free(v);
+  return argv;
+}
+
+/**
+ * expand words @wv into an argument vector.
+ * words with substitutions are expanded and then split by PISH_IFS,
+ * other words are copied from the fields cached by parser.
+ */
+char **pish_words(struct pish_word *wv, int wc) {
+  int n = 0;
+  int max = 0;
+  char **argv = sv_push(NULL, &n, &max, NULL);
+
+  n = 0;
+
+  for (int i = 0; i < wc; i++) {
+    char **fv = wv[i].fv;
+
+    if (wv[i].splice) { /* copy elements straight into argv */
+      struct pish_array *a = ht_get(&pish_arrays, wv[i].splice);
+
+      if (strcmp(wv[i].splice, "@") == 0)
+        fv = (pish_argc > 1) ? &pish_argv[1] : STRV(NULL);
+      else
+        fv = a ? a->v : STRV(NULL);
+
+      argv = realloc(argv, (n + sv_len(fv) + 1) * sizeof(char *));
+      max = n + sv_len(fv) + 1;
+
+      while (*fv)
+        argv[n++] = strclo(*fv++);
+
+      argv[n] = NULL;
+      continue;
+    }
+
+    if (wv[i].brace) {
+      argv = pish_push_brace(argv, &n, &max, &wv[i]);
+      continue;
+    }
+
+    if (fv) {
+      while (*fv)
+        argv = pish_push_field(argv, &n, &max, strclo(*fv++), wv[i].glob);
+      continue;
+    }
+
+    char *s = pish_expand(wv[i].raw);
+
+    if (!s)
+      continue;
+
+    char **v = pish_fold(s, PISH_IFS, false);
+
+    for (fv = v; *fv; fv++)
+      argv = pish_push_field(argv, &n, &max, *fv, wv[i].glob);
+
+    free(v);
+    free(s);
+  }
+
+  return argv;
+}
+
+/** expand word @w into one string, without splitting it */
+char *pish_word(struct pish_word *w) {
+  char *s = pish_expand(w->raw);
+  char **v = pish_fold(s ?: "", "", false);
+  char *ws = strclo(v[0] ?: "");
+
+  sv_free(v);
+  free(s);
+  return ws;
+}
+
+/* pending break (> 0) or continue (< 0) levels */
+static int pish_loopctl;
+/* depth of running loops */
+static int pish_loopdepth;
+/* pending return from a function */
+static bool pish_returning;
+/* depth of running functions */
+static int pish_funcdepth;
+/* last status is of a command tested by && or ||, it stops no script */
+static bool pish_tested;
+
+/** test if a list should stop for a break, continue or return */
+static inline bool pish_jumping(void) { return pish_loopctl || pish_returning; }
+
+/**
+ * consume a level of pending break or continue after a loop body,
+ * return true if the loop should be left.
+ */
+static bool pish_loop_leave(void) {
+  if (pish_returning)
+    return true;
+
+  if (pish_loopctl > 0) {
+    pish_loopctl--;
+    return true;
+  }
+
+  if (pish_loopctl < 0)
+    return ++pish_loopctl != 0;
+
+  return false;
+}
+
+int pish_run(struct pish_node *n, int fds[2]);
+static int pish_run_node(struct pish_node *n, int fds[2]);
+
+/**
+ * call function @body with arguments @argv,
+ * positional arguments are replaced during the call.
+ */
+static int pish_call(struct pish_node *body, char **argv, int fds[2]) {
+  int argc = pish_argc;
+  char **av = pish_argv;
+  int loopdepth = pish_loopdepth;
+
+  pish_argc = sv_len(argv);
+  pish_argv = argv;
+  pish_loopdepth = 0;
+  pish_funcdepth++;
+  body->refs++; /* it may be redefined while running */
+
+  int status = pish_run(body, fds);
+
+  pish_node_free(body);
+  pish_funcdepth--;
+  pish_returning = false;
+  pish_loopdepth = loopdepth;
+  pish_argv = av;
+  pish_argc = argc;
+  return status;
+}
+
+/** perform assignment @n, name[index]=value sets an array element */
+static void pish_assign(struct pish_node *n) {
+  struct pish_array *a;
+  char *lb = strchr(n->name, '[');
+
+  if (n->list) { /* the array takes expanded words */
+    char **v = pish_words(n->wv, n->wc);
+
+    a = pish_array_new(n->name);
+    free(a->v);
+    a->v = v;
+    a->n = a->max = sv_len(v);
+    return;
+  }
+
+  char *val = pish_word(&n->wv[0]);
+
+  if (!lb) {
+    setenv(n->name, val, 1);
+    free(val);
+    return;
+  }
+
+  char *name = strsub(n->name, lb - n->name);
+  long m = strtol(lb + 1, NULL, 10);
+
+  if (!(a = ht_get(&pish_arrays, name)))
+    a = pish_array_new(name);
+
+  if (m < 0) {
+    free(val);
+  } else {
+    while (a->n <= m)
+      pish_array_push(a, strclo(""));
+
+    free(a->v[m]);
+    a->v[m] = val;
+  }
+
+  free(name);
+}
+
+/**
+ * apply redirections @r on @fds, in their order,
+ * set @own[i] if @fds[i] is a file opened here, which caller closes.
+ * return false if a file cannot be opened.
+ */
+static bool pish_redirect(struct pish_node *r, int fds[2], bool own[2]) {
+  for (; r; r = r->next) {
+    char *target = pish_word(&r->wv[0]);
+    int i = (r->name[0] == '>');
+    int fd;
+
+    if (r->name[1] == '&')
+      fd = atoi(target);
+    else if (i == 0)
+      fd = open(target, O_RDONLY | O_CLOEXEC);
+    else
+      fd = open(target,
+                O_WRONLY | O_CREAT | O_CLOEXEC |
+                    (r->name[1] == '>' ? O_APPEND : O_TRUNC),
+                0666);
+
+    if (fd < 0 || (r->name[1] == '&' && fcntl(fd, F_GETFD) < 0)) {
+      fprintf(stderr, "pish: %s: %s\n", target, strerror(errno));
+      free(target);
+      return false;
+    }
+
+    if (own[i])
+      close(fds[i]);
+
+    fds[i] = fd;
+    own[i] = (r->name[1] != '&');
+    free(target);
+  }
+
+  return true;
+}
+
+static void pish_flow_forget(void);
+
+/**
+ * fork a subshell for a stage running on @fds,
+ * the child closes ends of pipes @pipev[1..@cnt-1] it does not use,
+ * which are -1 once closed by shell.
+ */
+static pid_t pish_subshell(int fds[2], int (*pipev)[2], int cnt) {
+  fflush(NULL); /* not to flush the same buffers twice */
+  pish_rbuf_give();
+
+  pid_t pid = fork();
+
+  if (pid != 0)
+    return pid;
+
+  signal(SIGPIPE, SIG_DFL);
+  pish_flow_forget();
+  pish_in_subshell = true;
+
+  if (pish_sched_next && !pish_sched_apply(pish_sched_next))
+    _exit(126);
+
+  pish_sched_next = NULL; /* its children inherit them anyway */
+
+  for (int i = 1; i < cnt; i++)
+    for (int j = 0; j < 2; j++)
+      if (pipev[i][j] >= 0 && !pish_isvfd(pipev[i][j]) &&
+          pipev[i][j] != fds[0] && pipev[i][j] != fds[1])
+        close(pipev[i][j]);
+
+  return 0;
+}
+
+/** leave a subshell with @status, as a child which exec'd would */
+static void pish_subshell_exit(int status) {
+  fflush(NULL);
+  _exit(status & 0xff);
+}
+
+/**
+ * start @argv with scheduling attributes @sc, the child is stored in @pid.
+ * a builtin or function runs in a subshell, which takes @sc itself,
+ * closing pipes @pipev of @cnt stages it does not use.
+ */
+static int pish_sched_exec(char **argv, int fds[2], pid_t *pid,
+                           struct pish_sched *sc, int (*pipev)[2], int cnt) {
+  struct pish_sched *outer = pish_sched_next;
+  int status;
+
+  pish_sched_next = sc;
+
+  if (ht_get(&pish_funcs, argv[0]) || pish_builtin(argv[0])) {
+    if ((*pid = pish_subshell(fds, pipev, cnt)) == 0) {
+      pid_t p;
+
+      status = pish_exec(argv, fds, &p);
+      pish_subshell_exit(p ? pish_wait(p) : status);
+    }
+
+    status = (*pid < 0);
+    *pid = (*pid < 0) ? 0 : *pid;
+  } else
+    status = pish_exec(argv, fds, pid);
+
+  pish_sched_next = outer;
+  return status;
+}
+
+int pish_ulimit(char **argv, int fds[2]) {
+  const struct pish_rlim *show[ARRAY_SIZE(pish_rlims)];
+  struct pish_sched sc;
+  int nshow;
+  int i = pish_ulimit_parse(argv, &sc, show, &nshow);
+  pid_t pid;
+
+  if (i < 0)
+    return 2;
+
+  if (argv[i]) {
+    int status = pish_sched_exec(&argv[i], fds, &pid, &sc, NULL, 0);
+
+    return pid ? pish_wait(pid) : status;
+  }
+
+  if (!nshow && !sc.nlim)
+    show[nshow++] = &pish_rlims[2];
+
+  if (sc.nlim && !pish_sched_apply(&sc))
+    return 1;
+
+  for (int k = 0; k < nshow; k++) {
+    struct rlimit rl;
+    char buf[24] = "unlimited";
+
+    getrlimit(show[k]->res, &rl);
+
+    rlim_t v = (sc.hard && !sc.soft) ? rl.rlim_max : rl.rlim_cur;
+
+    if (v != RLIM_INFINITY)
+      sprintf(buf, "%llu", (unsigned long long)(v / show[k]->unit));
+
+    if (nshow > 1)
+      pish_xprintf(fds[1], "%-26s -%c %s\n", show[k]->name, show[k]->opt,
+                   buf);
+    else
+      pish_xprintf(fds[1], "%s\n", buf);
+  }
+
+  return 0;
+}
+
+int pish_sched(char **argv, int fds[2]) {
+  struct pish_sched sc;
+  int i = pish_sched_parse(argv, &sc);
+  pid_t pid;
+
+  if (i < 0)
+    return 2;
+
+  if (!argv[i])
+    return 0;
+
+  int status = pish_sched_exec(&argv[i], fds, &pid, &sc, NULL, 0);
+
+  return pid ? pish_wait(pid) : status;
+}
+
+/**
+ * if @argv is sched, or ulimit with a command, parse its options into
+ * @sc and return index of the command, -1 on error, otherwise 0.
+ */
+static int pish_prefix(char **argv, struct pish_sched *sc) {
+  const struct pish_rlim *show[ARRAY_SIZE(pish_rlims)];
+  struct pish_cmd_desc *desc;
+  int nshow;
+  int k;
+
+  if (!argv[0] || ht_get(&pish_funcs, argv[0]) ||
+      !(desc = pish_builtin(argv[0])))
+    return 0;
+
+  if (desc->exec == pish_sched)
+    return pish_sched_parse(argv, sc);
+
+  if (desc->exec != pish_ulimit)
+    return 0;
+
+  k = pish_ulimit_parse(argv, sc, show, &nshow);
+  return (k < 0 || argv[k]) ? k : 0;
+}
+
+/**
+ * run a stage of pipeline, if it forks, the child is stored in @pid.
+ * if pipes @pipev of @cnt stages are given, more stages follow this one,
+ * and a command which would run in the shell runs in a subshell instead,
+ * so that it streams with the others and never blocks on a full pipe.
+ */
+static int pish_stage(struct pish_node *n, int fds[2], pid_t *pid,
+                      int (*pipev)[2], int cnt) {
+  int rfds[2] = {fds[0], fds[1]};
+  bool own[2] = {false, false};
+  int status = 1;
+
+  *pid = 0;
+
+  if (n->redir && !pish_redirect(n->redir, rfds, own))
+    goto out;
+
+  if (n->type != PISH_CMD) { /* compound commands run in the shell */
+    if (!pipev && n->type != PISH_SUBSHELL)
+      status = pish_run_node(n, rfds);
+    else if ((*pid = pish_subshell(rfds, pipev, pipev ? cnt : 0)) == 0)
+      pish_subshell_exit(n->type == PISH_SUBSHELL ? pish_run(n->kid, rfds)
+                                                  : pish_run_node(n, rfds));
+    else
+      status = (*pid < 0);
+
+    goto out;
+  }
+
+  status = 0;
+
+  for (struct pish_node *a = n->kid; a; a = a->next)
+    pish_assign(a);
+
+  char **argv = pish_words(n->wv, n->wc);
+  struct pish_sched sc;
+  int k;
+
+  if ((k = pish_prefix(argv, &sc)) != 0) { /* a prefix, not a process */
+    if (k < 0)
+      status = 2;
+    else if (argv[k])
+      status = pish_sched_exec(&argv[k], rfds, pid, &sc, pipev, cnt);
+  } else if (argv[0] && pipev &&
+             (ht_get(&pish_funcs, argv[0]) || pish_builtin(argv[0]))) {
+    if ((*pid = pish_subshell(rfds, pipev, cnt)) == 0) {
+      pid_t p;
+
+      status = pish_exec(argv, rfds, &p);
+      pish_subshell_exit(p ? pish_wait(p) : status);
+    }
+
+    status = (*pid < 0);
+  } else if (argv[0])
+    status = pish_exec(argv, rfds, pid);
+
+  sv_free(argv);
+out:
+  /* a child has its own copies by now */
+  for (int i = 0; i < 2; i++)
+    if (own[i])
+      close(rfds[i]);
+
+  return status;
+}
+
+/** builtin stage @s surely runs, however its words expand, or NULL */
+static struct pish_cmd_desc *pish_stage_builtin(struct pish_node *s) {
+  struct pish_cmd_desc *desc;
+  char **fv = (s->type == PISH_CMD && s->wc > 0) ? s->wv[0].fv : NULL;
+
+  if (!fv || !fv[0] || fv[1] || s->wv[0].glob || s->redir || s->kid ||
+      ht_get(&pish_funcs, fv[0]) || !(desc = pish_builtin(fv[0])) || desc->dl)
+    return NULL;
+
+  return desc;
+}
+
+/** a pure builtin stage running on a thread */
+struct pish_task {
+  pthread_t tid;
+  struct pish_cmd_desc *desc;
+  char **argv;
+  int fds[2];
+  bool own_in; /* input is made by pipeline, so it is closed when done */
+  atomic_bool done;
+  _Atomic int wake; /* a byte to it tells a flow monitor it is done */
+};
+
+static void *pish_task_run(void *arg) {
+  struct pish_task *t = arg;
+
+  pish_in_task = true;
+  t->desc->exec(t->argv, t->fds);
+  pish_xclose(t->fds[1]); /* the next stage sees end of input */
+
+  if (t->own_in)
+    pish_xclose(t->fds[0]);
+
+  t->done = true;
+
+  int w = t->wake;
+
+  if (w >= 0 && write(w, "", 1) < 0)
+    perror("pish");
+
+  return NULL;
+}
+
+/*
+ * flow monitor of a pipeline, turned on by set -o flowstat.
+ * every FLOWSTAT_INTERVAL ms it samples how full the pipe in front of
+ * each stage is, by FIONREAD on a dup of its read end, or counters of
+ * a channel, and CPU time of each stage, from /proc/PID/stat for a
+ * child or the clock of its thread otherwise. a stage whose input is
+ * full while its output is empty is the one others wait for.
+ */
+#define PISH_FLOW_INTERVAL 500 /* ms */
+
+struct pish_flow_stage {
+  const char *name;
+  _Atomic pid_t pid;      /* a child running the stage */
+  _Atomic int pidfd;      /* readable once the child exits */
+  struct pish_task *task; /* or a thread */
+  atomic_bool shell;      /* or the shell itself, until it is done */
+  clockid_t clock;        /* of the thread or the shell */
+  _Atomic int in;         /* dup of input pipe, a channel, or -1 */
+  int cap;                /* room of input */
+  int fill;               /* percent of input filled, last sample */
+  long full;              /* samples with input almost full */
+  long empty;             /* samples with input empty */
+  _Atomic double cpu;     /* seconds, last sample */
+  atomic_bool started;
+};
+
+struct pish_flow {
+  pthread_t tid;
+  int cnt;
+  int wake[2]; /* a byte wakes the monitor, and end of it stops it */
+  long samples;
+  struct timespec start;
+  struct pish_flow_stage *sv;
+  struct pish_flow *next; /* outer pipeline running the shell */
+};
+
+/* monitors running, innermost first */
+static struct pish_flow *pish_flows;
+
+/** in a subshell, drop ends of pipes held by monitors of the shell */
+static void pish_flow_forget(void) {
+  for (struct pish_flow *f = pish_flows; f; f = f->next) {
+    for (int i = 0; i < f->cnt; i++) {
+      int fd = f->sv[i].in;
+
+      if (fd >= 0 && !pish_isvfd(fd))
+        close(fd);
+
+      if (f->sv[i].pidfd >= 0)
+        close(f->sv[i].pidfd);
+    }
+
+    close(f->wake[0]);
+    close(f->wake[1]);
+  }
+
+  pish_flows = NULL;
+}
+
+/** stop sampling input of stage @st, its reader is gone */
+static void pish_flow_drop(struct pish_flow_stage *st) {
+  int fd = atomic_exchange(&st->in, -1);
+
+  if (fd < 0)
+    return;
+
+  if (pish_isvfd(fd))
+    pish_chan_unref(fd);
+  else
+    close(fd);
+}
+
+/** sample CPU time of stage @st, return false once it is gone */
+static bool pish_flow_cpu(struct pish_flow_stage *st) {
+  struct timespec ts;
+  pid_t pid = st->pid;
+
+  if (!st->started)
+    return true;
+
+  if (pid > 0) {
+    char path[32];
+    char buf[512];
+    unsigned long ut, kt;
+    char state;
+    int fd;
+    ssize_t n = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+      n = read(fd, buf, sizeof(buf) - 1);
+      close(fd);
+    }
+
+    char *p = (n > 0) ? (buf[n] = '\0', strrchr(buf, ')')) : NULL;
+
+    if (!p || sscanf(p + 1,
+                     " %c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                     &state, &ut, &kt) != 3)
+      return false;
+
+    st->cpu = (double)(ut + kt) / sysconf(_SC_CLK_TCK);
+    return state != 'Z' && state != 'X';
+  }
+
+  if ((st->task && st->task->done) || (!st->task && !st->shell))
+    return false;
+
+  if (clock_gettime(st->clock, &ts) == 0)
+    st->cpu = ts.tv_sec + ts.tv_nsec / 1e9;
+
+  return true;
+}
+
+static void pish_flow_sample(struct pish_flow *f) {
+  f->samples++;
+
+  for (int i = 0; i < f->cnt; i++) {
+    struct pish_flow_stage *st = &f->sv[i];
+    int fd;
+    int n = 0;
+
+    if (!pish_flow_cpu(st))
+      pish_flow_drop(st);
+
+    if ((fd = st->in) < 0)
+      continue;
+
+    if (pish_isvfd(fd)) {
+      struct pish_chan *c = pish_chan(fd);
+
+      n = c->head - c->tail;
+    } else if (ioctl(fd, FIONREAD, &n) < 0)
+      continue;
+
+    st->fill = (int)(100L * n / st->cap);
+    st->full += (st->fill >= 90);
+    st->empty += (n == 0);
+  }
+}
+
+/** print a line of last sample, stage [cpu] in% stage ... */
+static void pish_flow_print(struct pish_flow *f) {
+  char line[1024];
+  int len = 0;
+
+  for (int i = 0; i < f->cnt && len < (int)sizeof(line); i++) {
+    struct pish_flow_stage *st = &f->sv[i];
+
+    if (i > 0)
+      len += snprintf(line + len, sizeof(line) - len, " |%d%%| ", st->fill);
+
+    if (len < (int)sizeof(line))
+      len += snprintf(line + len, sizeof(line) - len, "%s %.2fs", st->name,
+                      st->cpu);
+  }
+
+  fprintf(stderr, "flowstat: %s\n", line);
+}
+
+/**
+ * sample until the wake pipe ends, a stage which exits wakes it early,
+ * so that a producer never waits on an input held only by monitor.
+ */
+static void *pish_flow_run(void *arg) {
+  struct pish_flow *f = arg;
+  char *s = getenv("FLOWSTAT_INTERVAL");
+  int ms = (s && atoi(s) > 0) ? atoi(s) : PISH_FLOW_INTERVAL;
+  struct pollfd *pv = malloc((f->cnt + 1) * sizeof(struct pollfd));
+  char c;
+
+  for (;;) {
+    int k = 1;
+
+    pv[0] = (struct pollfd){f->wake[0], POLLIN, 0};
+
+    for (int i = 0; i < f->cnt; i++)
+      if (f->sv[i].pidfd >= 0)
+        pv[k++] = (struct pollfd){f->sv[i].pidfd, POLLIN, 0};
+
+    int r = poll(pv, k, ms);
+
+    if (r > 0 && pv[0].revents && read(f->wake[0], &c, 1) <= 0)
+      break;
+
+    for (int i = 0, j = 1; r > 0 && i < f->cnt; i++)
+      if (f->sv[i].pidfd >= 0 && f->sv[i].pidfd == pv[j].fd &&
+          pv[j++].revents) {
+        close(f->sv[i].pidfd);
+        f->sv[i].pidfd = -1;
+      }
+
+    pish_flow_sample(f);
+
+    if (r == 0)
+      pish_flow_print(f);
+  }
+
+  free(pv);
+  return NULL;
+}
+
+/** start a monitor for pipeline @n, with pipes @pipev built */
+static struct pish_flow *pish_flow_start(struct pish_node *n, int cnt,
+                                         int (*pipev)[2]) {
+  struct pish_flow *f = calloc(1, sizeof(struct pish_flow));
+  struct pish_node *s = n->kid;
+
+  f->cnt = cnt;
+  f->sv = calloc(cnt, sizeof(struct pish_flow_stage));
+  clock_gettime(CLOCK_MONOTONIC, &f->start);
+
+  for (int i = 0; i < cnt; i++, s = s->next) {
+    struct pish_flow_stage *st = &f->sv[i];
+    int fd = pipev[i][0];
+
+    st->name = (s->type == PISH_CMD && s->wc > 0) ? s->wv[0].raw : "{...}";
+    st->in = -1;
+    st->pidfd = -1;
+
+    if (i == 0)
+      continue;
+
+    if (pish_isvfd(fd)) {
+      pish_chan(fd)->refs++;
+      st->in = fd;
+      st->cap = PISH_CHAN_SIZE;
+    } else if ((st->in = fcntl(fd, F_DUPFD_CLOEXEC, 0)) >= 0)
+      st->cap = fcntl(fd, F_GETPIPE_SZ) ?: 1;
+  }
+
+  pipe2(f->wake, O_CLOEXEC);
+
+  if (pthread_create(&f->tid, NULL, pish_flow_run, f) != 0)
+    f->tid = 0;
+
+  f->next = pish_flows;
+  pish_flows = f;
+  return f;
+}
+
+/** stage @i is started, as @pid, thread @t, or in the shell */
+static void pish_flow_stage(struct pish_flow *f, int i, pid_t pid,
+                            struct pish_task *t) {
+  struct pish_flow_stage *st = &f->sv[i];
+
+  if (t && pthread_getcpuclockid(t->tid, &st->clock) == 0) {
+    st->task = t;
+    t->wake = f->wake[1];
+
+    if (t->done && write(f->wake[1], "", 1) < 0) /* before it knew us */
+      perror("pish");
+  } else if (!t && !pid &&
+             pthread_getcpuclockid(pthread_self(), &st->clock) == 0)
+    st->shell = true;
+
+  if (pid) {
+    st->shell = false;
+    st->pidfd = syscall(SYS_pidfd_open, pid, 0);
+  }
+
+  st->pid = pid;
+  st->started = true;
+}
+
+/** stage @i run by the shell is done, its input is let go */
+static void pish_flow_done(struct pish_flow *f, int i) {
+  f->sv[i].shell = false;
+
+  if (write(f->wake[1], "", 1) < 0)
+    pish_flow_drop(&f->sv[i]);
+}
+
+/** child of stage @i has exited, take its CPU time before it is reaped */
+static void pish_flow_reap(struct pish_flow *f, int i) {
+  siginfo_t si;
+
+  if (waitid(P_PID, f->sv[i].pid, &si, WEXITED | WNOWAIT) == 0)
+    pish_flow_cpu(&f->sv[i]);
+
+  f->sv[i].pid = 0;
+}
+
+/**
+ * stop the monitor of a pipeline which is done,
+ * and report where its data piled up.
+ */
+static void pish_flow_end(struct pish_flow *f) {
+  struct timespec now;
+  int worst = 0;
+  double score = -1;
+
+  close(f->wake[1]);
+
+  if (f->tid)
+    pthread_join(f->tid, NULL);
+
+  close(f->wake[0]);
+  pish_flows = f->next;
+
+  for (int i = 0; i < f->cnt; i++)
+    if (f->sv[i].pidfd >= 0)
+      close(f->sv[i].pidfd);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  double secs = (now.tv_sec - f->start.tv_sec) +
+                (now.tv_nsec - f->start.tv_nsec) / 1e9;
+  long m = f->samples ?: 1;
+
+  fprintf(stderr, "flowstat: %.2fs, %ld samples\n", secs, f->samples);
+
+  for (int i = 0; i < f->cnt; i++) {
+    struct pish_flow_stage *st = &f->sv[i];
+    double full = (i > 0) ? (double)st->full / m : 1;
+    double empty = (i + 1 < f->cnt) ? (double)f->sv[i + 1].empty / m : 1;
+
+    if (f->samples && full + empty > score) {
+      score = full + empty;
+      worst = i;
+    }
+
+    fprintf(stderr, "  %d %-8s cpu %6.2fs", i, st->name, st->cpu);
+
+    if (i > 0)
+      fprintf(stderr, "  input full %3.0f%% empty %3.0f%%", 100 * full,
+              100.0 * st->empty / m);
+
+    fputc('\n', stderr);
+    pish_flow_drop(st);
+  }
+
+  if (f->samples)
+    fprintf(stderr, "flowstat: bottleneck is stage %d %s\n", worst,
+            f->sv[worst].name);
+
+  free(f->sv);
+  free(f);
+}
+
+/**
+ * branches fed by a pipeline, each reads its own pipe, and the shell
+ * duplicates output of the pipeline into all of them in kernel.
+ */
+struct pish_fan {
+  pthread_t tid;
+  int cnt;          /* number of branches */
+  int (*pipev)[2];  /* [1] is the pipe from pipeline, [2..] to branches */
+  pid_t *pidv;
+};
+
+#define PISH_FAN_PIPE (1 << 20) /* room of a branch pipe, for slack */
+
+/** write @len bytes of @buf to branch @i, or drop the branch */
+static void pish_fan_put(struct pish_fan *f, int i, const char *buf,
+                         ssize_t len) {
+  if (len > 0 && pish_xwrite(f->pipev[i][1], buf, len) < 0) {
+    close(f->pipev[i][1]);
+    f->pipev[i][1] = -1;
+  }
+}
+
+/** tee @n bytes of pipe to branch @i, return bytes duplicated */
+static ssize_t pish_fan_tee(struct pish_fan *f, int i, ssize_t n) {
+  ssize_t m;
+
+  while ((m = tee(f->pipev[1][0], f->pipev[i][1], n, 0)) < 0 &&
+         errno == EINTR)
+    ;
+
+  if (m < 0) { /* the branch is gone, it misses nothing */
+    close(f->pipev[i][1]);
+    f->pipev[i][1] = -1;
+    return n;
+  }
+
+  return m;
+}
+
+/**
+ * duplicate pipeline output to live branches: tee(2) it to all of them
+ * but the last one, which takes it by splice. a branch may take less
+ * than the others when its pipe is full, then this round goes through
+ * a buffer instead. the slowest branch sets the pace of all.
+ */
+static void *pish_fan_run(void *arg) {
+  struct pish_fan *f = arg;
+  int in = f->pipev[1][0];
+  ssize_t *got = malloc((f->cnt + 2) * sizeof(ssize_t));
+  char *buf = NULL;
+
+  for (;;) {
+    int first = 0;
+    int last = 0;
+    ssize_t n;
+
+    for (int i = 2; i < f->cnt + 2; i++)
+      if (f->pipev[i][1] >= 0) {
+        first = first ?: i;
+        last = i;
+      }
+
+    if (!last)
+      break;
+
+    if (first == last) {
+      if ((n = splice(in, NULL, f->pipev[last][1], NULL, PISH_COPY_BLOCK,
+                      SPLICE_F_MOVE)) < 0 &&
+          errno == EINTR)
+        continue;
+
+      if (n < 0 && errno == EPIPE) {
+        close(f->pipev[last][1]);
+        f->pipev[last][1] = -1;
+        continue;
+      }
+
+      if (n <= 0)
+        break;
+
+      continue;
+    }
+
+    if ((n = tee(in, f->pipev[first][1], PISH_COPY_BLOCK, 0)) < 0) {
+      if (errno == EINTR)
+        continue;
+
+      if (errno == EPIPE) {
+        close(f->pipev[first][1]);
+        f->pipev[first][1] = -1;
+        continue;
+      }
+    }
+
+    if (n <= 0)
+      break;
+
+    bool short_round = false;
+
+    for (int i = first + 1; i < last; i++)
+      if (f->pipev[i][1] >= 0 && (got[i] = pish_fan_tee(f, i, n)) < n)
+        short_round = true;
+
+    ssize_t m = 0;
+
+    while (!short_round && m < n) {
+      ssize_t k = splice(in, NULL, f->pipev[last][1], NULL, n - m,
+                         SPLICE_F_MOVE);
+
+      if (k > 0)
+        m += k;
+      else if (k < 0 && errno == EINTR)
+        continue;
+      else
+        short_round = true; /* the rest goes through the buffer */
+    }
+
+    if (!short_round)
+      continue;
+
+    if (!buf)
+      buf = malloc(PISH_COPY_BLOCK);
+
+    for (ssize_t r = 0; r < n - m;) {
+      ssize_t k = read(in, buf + r, n - m - r);
+
+      if (k > 0)
+        r += k;
+      else if (k == 0 || errno != EINTR)
+        goto out;
+    }
+
+    /* buf holds [m, n) of this round, a short tee means m is 0 */
+    for (int i = first + 1; i < last; i++)
+      if (f->pipev[i][1] >= 0 && got[i] < n)
+        pish_fan_put(f, i, buf + got[i] - m, n - got[i]);
+
+    if (f->pipev[last][1] >= 0)
+      pish_fan_put(f, last, buf, n - m);
+  }
+
+out:
+  for (int i = 2; i < f->cnt + 2; i++)
+    if (f->pipev[i][1] >= 0)
+      close(f->pipev[i][1]);
+
+  close(in); /* a producer left alone gets SIGPIPE */
+  free(got);
+  free(buf);
+  return NULL;
+}
+
+/**
+ * start branches @b of a pipeline in subshells writing to @out,
+ * return write end of the pipe which feeds them.
+ */
+static int pish_fan_start(struct pish_fan *f, struct pish_node *b, int out) {
+  f->cnt = 0;
+
+  for (struct pish_node *k = b; k; k = k->next)
+    f->cnt++;
+
+  f->pipev = malloc((f->cnt + 2) * sizeof(int[2]));
+  f->pidv = calloc(f->cnt, sizeof(pid_t));
+  f->pipev[0][0] = f->pipev[0][1] = -1;
+
+  for (int i = 1; i < f->cnt + 2; i++) {
+    pipe2(f->pipev[i], O_CLOEXEC);
+
+    if (i > 1)
+      fcntl(f->pipev[i][1], F_SETPIPE_SZ, PISH_FAN_PIPE);
+  }
+
+  for (int i = 2; b; i++, b = b->next) {
+    int bfds[2] = {f->pipev[i][0], out};
+
+    if ((f->pidv[i - 2] = pish_subshell(bfds, f->pipev, f->cnt + 2)) == 0)
+      pish_subshell_exit(pish_run(b->kid, bfds));
+
+    close(f->pipev[i][0]);
+    f->pipev[i][0] = -1;
+  }
+
+  if (pthread_create(&f->tid, NULL, pish_fan_run, f) != 0)
+    f->tid = 0;
+
+  return f->pipev[1][1];
+}
+
+/**
+ * wait for branches after the pipeline is done, statuses of all
+ * branches are put in array FANSTATUS, the last one is returned.
+ */
+static int pish_fan_end(struct pish_fan *f) {
+  struct pish_array *a = pish_array_new("FANSTATUS");
+  int status = 0;
+
+  close(f->pipev[1][1]);
+
+  if (f->tid)
+    pthread_join(f->tid, NULL);
+  else
+    pish_fan_run(f);
+
+  for (int i = 0; i < f->cnt; i++) {
+    char buf[12];
+
+    status = (f->pidv[i] > 0) ? pish_wait(f->pidv[i]) : 1;
+    sprintf(buf, "%d", status);
+    pish_array_push(a, strclo(buf));
+  }
+
+  free(f->pidv);
+  free(f->pipev);
+  return status;
+}
+
+/**
+ * execute stages of pipeline @n as subprocesses
+ * and piping their I/O to the next one by one.
+ * use @fds[0] as input and print result to @fds[1].
+ * return status of the last stage.
+ *
+ * READ END fds[0] -+   pipev[1][0] --+    X
+ *                  |      ||         |
+ *                 cmd0    ||        cmd1
+ *                  |      ||         |
+ * WRITE END   X    +-> pipev[1][1]   +-> fds[1]
+ *
+ * pure builtins in front of the last stage run on threads, and two
+ * neighbours both running in the shell talk through a channel instead
+ * of a pipe, so that their data never goes through the kernel.
+ * with branches, output goes to them instead, see pish_fan_run().
+ */
+int pish_pipe(struct pish_node *n, int fds[2]) {
+  struct pish_fan fan;
+  int status = 0;
+  int cnt = 0;
+
+  for (struct pish_node *s = n->kid; s; s = s->next)
+    cnt++;
+
+  int(*pipev)[2] = malloc((1 + cnt) * sizeof(int[2]));
+  pid_t *pidv = malloc(cnt * sizeof(pid_t));
+  struct pish_task *taskv = calloc(cnt, sizeof(struct pish_task));
+  struct pish_cmd_desc *last = NULL;
+  struct pish_node *s = n->kid;
+
+  for (int i = 0; i < cnt; i++, s = s->next) {
+    struct pish_cmd_desc *desc = pish_stage_builtin(s);
+
+    if (i + 1 == cnt)
+      last = desc;
+    else if (desc && desc->pure)
+      taskv[i].desc = desc;
+  }
+
+  /* branches are forked first, so that they hold no ends of our pipes */
+  int out = n->alt ? pish_fan_start(&fan, n->alt, fds[1]) : fds[1];
+
+  /* build pipes, children must not inherit the ends they do not use */
+  pipev[0][0] = fds[0];
+
+  for (int i = 1; i < cnt; i++) {
+    bool fused = taskv[i - 1].desc && (taskv[i].desc || (i + 1 == cnt && last));
+
+    if (!fused || !pish_chan_open(pipev[i]))
+      pipe2(pipev[i], O_CLOEXEC);
+  }
+
+  pipev[cnt][1] = out;
+  s = n->kid;
+
+  struct pish_flow *flow =
+      (pish_flowstat && cnt > 1) ? pish_flow_start(n, cnt, pipev) : NULL;
+
+  /* every stage but the last may have to run in a subshell */
+  for (int i = 0; i < cnt; ++i, s = s->next) {
+    struct pish_task *t = &taskv[i];
+
+    pidv[i] = 0;
+
+    if (t->desc) { /* the thread closes its own ends */
+      t->argv = pish_words(s->wv, s->wc);
+      t->fds[0] = pipev[i][0];
+      t->fds[1] = pipev[i + 1][1];
+      t->own_in = (i > 0);
+      t->wake = -1;
+
+      if (i == 0)
+        pish_rbuf_give();
+
+      if (pthread_create(&t->tid, NULL, pish_task_run, t) == 0) {
+        if (flow)
+          pish_flow_stage(flow, i, 0, t);
+        continue;
+      }
+
+      pish_task_run(t);
+      t->desc = NULL;
+      continue;
+    }
+
+    if (flow && i + 1 == cnt)
+      pish_flow_stage(flow, i, 0, NULL);
+
+    status = pish_stage(s, (int[2]){pipev[i][0], pipev[i + 1][1]}, &pidv[i],
+                        (i + 1 < cnt) ? pipev : NULL, cnt);
+
+    if (flow && pidv[i] > 0)
+      pish_flow_stage(flow, i, pidv[i], NULL);
+    else if (flow && i + 1 == cnt)
+      pish_flow_done(flow, i);
+
+    /* close the ends here so that the neighbours won't get blocked. */
+    if (i > 0) {
+      pish_xclose(pipev[i][0]);
+      pipev[i][0] = -1;
+    }
+
+    if (i + 1 < cnt) {
+      pish_xclose(pipev[i + 1][1]);
+      pipev[i + 1][1] = -1;
+    }
+  }
+
+  /* wait for children, the last stage tells the status */
+  for (int i = 0; i < cnt; ++i) {
+    if (pidv[i] > 0) {
+      if (flow)
+        pish_flow_reap(flow, i);
+
+      int st = pish_wait(pidv[i]);
+
+      if (i + 1 == cnt)
+        status = st;
+    }
+
+    if (taskv[i].desc)
+      pthread_join(taskv[i].tid, NULL);
+
+    sv_free(taskv[i].argv);
+  }
+
+  if (flow)
+    pish_flow_end(flow);
+
+  free(taskv);
+  free(pidv);
+  free(pipev);
+
+  if (n->alt)
+    status = pish_fan_end(&fan);
+
+  if (n->bang)
+    status = !status;
+
+  sprintf(pish_status, "%d", status);
+  return status;
+}
+
+/** for loop, iterate over positional arguments if no word is given */
+static int pish_for(struct pish_node *n, int fds[2]) {
+  int status = 0;
+  char **items;
+
+  if (n->wc < 0) {
+    int k = 0;
+    int max = 0;
+
+    items = sv_push(NULL, &k, &max, NULL);
+    k = 0;
+
+    for (int i = 1; i < pish_argc; i++)
+      items = sv_push(items, &k, &max, strclo(pish_argv[i]));
+  } else
+    items = pish_words(n->wv, n->wc);
+
+  pish_loopdepth++;
+
+  for (char **p = items; *p; p++) {
+    setenv(n->name, *p, 1);
+    status = pish_run(n->body, fds);
+
+    if (pish_loop_leave())
+      break;
+  }
+
+  pish_loopdepth--;
+  sv_free(items);
+  return status;
+}
+
+/** while and until loops */
+static int pish_while(struct pish_node *n, int fds[2]) {
+  int status = 0;
+
+  pish_loopdepth++;
+
+  while (true) {
+    bool cond = (pish_run(n->kid, fds) == 0);
+
+    if (pish_jumping() || cond != (n->type == PISH_WHILE)) {
+      pish_loop_leave();
+      break;
+    }
+
+    status = pish_run(n->body, fds);
+
+    if (pish_loop_leave())
+      break;
+  }
+
+  pish_loopdepth--;
+  return status;
+}
+
+/** case statement, run the first item with a matching pattern */
+static int pish_case(struct pish_node *n, int fds[2]) {
+  int status = 0;
+  char *word = pish_word(&n->wv[0]);
+
+  for (struct pish_node *item = n->body; item; item = item->next) {
+    for (int i = 0; i < item->wc; i++) {
+      char *pat = pish_word(&item->wv[i]);
+      bool match = (fnmatch(pat, word, 0) == 0);
+
+      free(pat);
+
+      if (match) {
+        status = pish_run(item->body, fds);
+        goto out;
+      }
+    }
+  }
+
+out:
+  free(word);
+  return status;
+}
+
+/** run node @n alone, with input @fds[0] and output @fds[1] */
+static int pish_run_node(struct pish_node *n, int fds[2]) {
+  int status = 0;
+
+  pish_tested = false;
+
+  switch (n->type) {
+  case PISH_PIPE:
+    status = pish_pipe(n, fds);
+    break;
+  case PISH_IF:
+    status = pish_run(n->kid, fds);
+
+    if (pish_jumping())
+      break;
+
+    if (status == 0)
+      status = pish_run(n->body, fds);
+    else
+      status = n->alt ? pish_run(n->alt, fds) : 0;
+    break;
+  case PISH_WHILE:
+  case PISH_UNTIL:
+    status = pish_while(n, fds);
+    break;
+  case PISH_FOR:
+    status = pish_for(n, fds);
+    break;
+  case PISH_CASE:
+    status = pish_case(n, fds);
+    break;
+  case PISH_GROUP:
+    status = pish_run(n->kid, fds);
+    break;
+  case PISH_AND:
+  case PISH_OR: /* the right side is skipped, never spawned */
+    status = pish_run_node(n->kid, fds);
+
+    if (!pish_jumping() && (status == 0) == (n->type == PISH_AND))
+      status = pish_run_node(n->body, fds);
+    else
+      pish_tested = true;
+    break;
+  case PISH_FUNC: /* define it, the table takes a reference */
+    n->body->refs++;
+    pish_node_free(ht_put(&pish_funcs, n->name, n->body));
+    status = 0;
+    break;
+  default: {
+    pid_t pid;
+
+    status = pish_stage(n, fds, &pid, NULL, 0);
+
+    if (pid > 0)
+      status = pish_wait(pid);
+  }
+  }
+
+  return status;
+}
+
+/**
+ * run a list of parsed nodes with input @fds[0] and output @fds[1],
+ * return status of the last one.
+ */
+int pish_run(struct pish_node *n, int fds[2]) {
+  int status = 0;
+
+  for (; n && !pish_jumping(); n = n->next)
+    status = pish_run_node(n, fds);
+
+  return status;
+}
+
+/** leave loops, or resume them if @cont is true */
+static int pish_jump(char **argv, bool cont) {
+  int n = argv[1] ? strtol(argv[1], NULL, 10) : 1;
+
+  if (pish_loopdepth == 0) {
+    fprintf(stderr, "%s: only meaningful in a loop\n", argv[0]);
+    return 0;
+  }
+
+  if (n < 1)
+    n = 1;
+
+  if (n > pish_loopdepth)
+    n = pish_loopdepth;
+
+  pish_loopctl = cont ? -n : n;
+  return 0;
+}
+
+int pish_break(char **argv, __unused int fds[2]) {
+  return pish_jump(argv, false);
+}
+
+int pish_continue(char **argv, __unused int fds[2]) {
+  return pish_jump(argv, true);
+}
+
+int pish_return(char **argv, __unused int fds[2]) {
+  if (pish_funcdepth == 0) {
+    fprintf(stderr, "%s: can only return from a function\n", argv[0]);
+    return 1;
+  }
+
+  pish_returning = true;
+  return argv[1] ? strtol(argv[1], NULL, 10) : strtol(pish_status, NULL, 10);
+}
+
+int pish_true(__unused char **argv, __unused int fds[2]) { return 0; }
+
+int pish_false(__unused char **argv, __unused int fds[2]) { return 1; }
+
+/* parsed commands of eval by their text, so they are parsed only once */
+#define PISH_EVAL_MAX 256
+static struct ht pish_eval_tab;
+
+/** drop all parsed commands of eval, a running one is freed by its eval */
+static void pish_eval_clear(void) {
+  struct ht *t = &pish_eval_tab;
+
+  for (size_t i = 0; i < t->cap; i++) {
+    while (t->bkt[i]) {
+      struct ht_ent *e = t->bkt[i];
+
+      t->bkt[i] = e->next;
+      pish_node_free(e->val);
+      free(e->key);
+      free(e);
+    }
+  }
+
+  t->cnt = 0;
+}
+
+/**
+ * join arguments by spaces and run them as commands, like a line
+ * of script. the parsed list is kept by its text, so a repeated eval
+ * only expands its words again.
+ */
+int pish_eval(char **argv, int fds[2]) {
+  if (!argv[0])
+    return -1;
+
+  if (!argv[1])
+    return 0;
+
+  char *src = sv_unfold(&argv[1], " ", NULL, NULL);
+  struct pish_node *list = ht_get(&pish_eval_tab, src);
+  int status = 0;
+
+  if (!list) {
+    status = pish_parse(src, &list);
+
+    if (status == PISH_EMORE)
+      fprintf(stderr, "syntax error: unexpected end of input\n");
+
+    if (list) {
+      if (pish_eval_tab.cnt >= PISH_EVAL_MAX)
+        pish_eval_clear();
+
+      ht_put(&pish_eval_tab, src, list);
+    }
+  }
+
+  free(src);
+
+  if (status || !list)
+    return status;
+
+  list->refs++; /* it may be dropped from the table while it runs */
+  status = pish_run(list, fds);
+  pish_node_free(list);
+  return status;
+}
+
+/** send @signum to all child processes */
+void pish_sweep(int signum) {
+  pid_t mypid = getpid();
+  pid_t pid;
+
+  while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+    if (pid != mypid) {
+      kill(pid, signum);
+    }
+  }
+}
+
+/** run a parsed command @list from top level and free it */
+static int pish_run_free(struct pish_node *list, int fds[2]) {
+  int status = pish_run(list, fds);
+
+  pish_loopctl = 0;
+  pish_returning = false;
+  pish_node_free(list);
+  return status;
+}
+
+/** entry */
+int pish(const char *cmdline, int fds[2]) {
+  struct pish_node *list;
+  int status = pish_parse(cmdline, &list);
+
+  if (status == PISH_EMORE)
+    fprintf(stderr, "syntax error: unexpected end of input\n");
+
+  if (status)
+    return status;
+
+  return pish_run_free(list, fds);
+}
+
+/** update the environment variables for repl */
+void pish_update_env(void) {
+  char *dirname = get_current_dir_name();
+
+  setenv("PWD", dirname, 1);
+
+  struct passwd *pw = getpwuid(getuid());
+  if (pw)
+    setenv("USER", pw->pw_name, 1);
+  else
+    setenv("USER", "", 1);
+
+  free(dirname);
+}
+
+/**
+ * read, evaluate, print line by line, @fd is the script.
+ * lines are taken from the read-ahead buffer of @fd, which maps a
+ * regular file and reads a pipe in large blocks, so a line costs no
+ * syscall. they are collected until they make up complete commands,
+ * so that a compound command can span several lines.
+ * if commands read @fd as well, it is shared with them, and left at
+ * the end of a command once it forks or reads @fd, so they get the rest.
+ */
+int pish_repl(int fd, int fds[2]) {
+  int status = 0;
+  bool share = fds[0] == fd;
+  struct pish_rbuf *rb = pish_rbuf_get(fd);
+  const char *line;
+  size_t len;
+  size_t cap = 0;
+  size_t n = 0; /* length of lines of an unfinished command */
+  char *src = NULL;
+
+  if (!rb)
+    return errno;
+
+  struct pish_rbuf *outer = pish_rbuf_shared;
+
+  if (share) {
+    pish_rbuf_share(rb);
+    pish_rbuf_shared = rb;
+  }
+
+  pish_update_env();
+
+  while (pish_rbuf_line(rb, &line, &len)) {
+    struct pish_node *list;
+
+    if (n + len + 1 > cap)
+      src = realloc(src, cap = (n + len + 1) * 2);
+
+    memcpy(src + n, line, len);
+    n += len;
+    src[n] = '\0';
+    status = pish_parse(src, &list);
+
+    if (status == PISH_EMORE) {
+      status = 0;
+      continue;
+    }
+
+    n = 0;
+
+    if (status)
+      break;
+
+    pish_rbuf_given = false;
+    status = pish_run_free(list, fds);
+
+    if (share && pish_rbuf_given) /* take the offset commands left */
+      pish_rbuf_get(fd);
+
+    if (status && !pish_tested)
+      break;
+  }
+
+  if (n > 0) {
+    fprintf(stderr, "syntax error: unexpected end of file\n");
+    status = PISH_ESYNTAX;
+  }
+
+  pish_rbuf_sync(rb);
+  pish_rbuf_reset(rb); /* do not keep a whole script mapped */
+  pish_rbuf_shared = outer;
+  free(src);
+  return status;
+}
+
+/** a pipe end read to its end by a thread, with data it has got */
+struct pish_drain {
+  int fd;
+  const char *data; /* data to write into fd instead, if not NULL */
+  char *buf;
+  size_t len;
+};
+
+/** read @arg->fd until end of input, or write @arg->data into it */
+static void *pish_drain(void *arg) {
+  struct pish_drain *d = arg;
+  size_t cap = 0;
+  ssize_t n;
+
+  if (d->data) {
+    for (size_t len = strlen(d->data); len > 0; len -= n, d->data += n)
+      if ((n = write(d->fd, d->data, len)) <= 0)
+        break;
+
+    close(d->fd);
+    return NULL;
+  }
+
+  for (;;) {
+    if (cap - d->len < PISH_RBUF_BLOCK) {
+      cap = cap ? cap * 2 : PISH_RBUF_BLOCK;
+      d->buf = realloc(d->buf, cap + 1);
+    }
+
+    if ((n = read(d->fd, d->buf + d->len, cap - d->len)) < 0 && errno == EINTR)
+      continue;
+
+    if (n <= 0)
+      break;
+
+    d->len += n;
+  }
+
+  d->buf[d->len] = '\0';
+  return NULL;
+}
+
+/**
+ * run pish() with bufferred input and output
+ * do not forget to free the output buffer.
+ * input and output are pumped by threads while the command runs,
+ * so that neither of them is limited by capacity of a pipe.
+ */
+char *pish_fifo(const char *cmdline, const char *input) {
+  int fds[2][2];
+  struct pish_drain in = {.data = input ?: ""};
+  struct pish_drain out = {0};
+  pthread_t tid[2];
+
+  pipe2(fds[0], O_CLOEXEC);
+  pipe2(fds[1], O_CLOEXEC);
+  in.fd = fds[0][1];
+  out.fd = fds[1][0];
+  pthread_create(&tid[0], NULL, pish_drain, &in);
+  pthread_create(&tid[1], NULL, pish_drain, &out);
+
+  int status = pish(cmdline, (int[2]){fds[0][0], fds[1][1]});
+
+  close(fds[0][0]);
+  close(fds[1][1]); /* the reader sees its end once children are gone */
+  pthread_join(tid[0], NULL);
+  pthread_join(tid[1], NULL);
+  close(fds[1][0]);
+
+  if (status || out.len == 0) {
+    free(out.buf);
+    return NULL;
+  }
+
+  return out.buf;
+}
+
+/** output of a command kept by cache */
+struct pish_cache_ent {
+  double expire; /* CLOCK_MONOTONIC seconds */
+  char *out;
+  size_t len;
+};
+
+#define PISH_CACHE_MAX 1024
+
+/* cached outputs by key */
+static struct ht pish_cache_tab;
+
+static double pish_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** drop entries expired by @now, or all of them if @now is 0 */
+static void pish_cache_sweep(double now) {
+  struct ht *t = &pish_cache_tab;
+
+  for (size_t i = 0; i < t->cap; i++) {
+    for (struct ht_ent **pe = &t->bkt[i]; *pe;) {
+      struct ht_ent *e = *pe;
+      struct pish_cache_ent *c = e->val;
+
+      if (now && c->expire > now) {
+        pe = &e->next;
+        continue;
+      }
+
+      *pe = e->next;
+      free(c->out);
+      free(c);
+      free(e->key);
+      free(e);
+      t->cnt--;
+    }
+  }
+}
+
+/** parse @s like 30, 30s, 5m, 2h or 1d into seconds, -1 if it is not */
+static double pish_cache_ttl(const char *s) {
+  char *end;
+  double v = strtod(s, &end);
+
+  switch (*end) {
+  case 'd':
+    v *= 24;
+    /* fall through */
+  case 'h':
+    v *= 60;
+    /* fall through */
+  case 'm':
+    v *= 60;
+    /* fall through */
+  case 's':
+    end++;
+    break;
+  }
 
-      free(key);
+  return (end == s || *end != '\0' || v < 0) ? -1 : v;
+}
+
+int pish_cache(char **argv, int fds[2]) {
+  double ttl = 60;
+  char **vars = NULL;
+  int nv = 0, maxv = 0;
+  int i = 1;
+
+  for (; argv[i] && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "--") == 0) {
+      i++;
+      break;
+    } else if (strcmp(argv[i], "-c") == 0) {
+      pish_cache_sweep(0);
+      free(vars);
+      return 0;
+    } else if (strcmp(argv[i], "-t") == 0 && argv[i + 1] &&
+               (ttl = pish_cache_ttl(argv[i + 1])) >= 0)
+      i++;
+    else if (strcmp(argv[i], "-v") == 0 && argv[i + 1])
+      vars = sv_push(vars, &nv, &maxv, argv[++i]);
+    else {
+      fprintf(stderr, "cache: bad option %s\n", argv[i]);
+      free(vars);
+      return 2;
     }
+  }
 
-    if (!val)
-      val = strclo("");
+  if (!argv[i]) {
+    free(vars);
+    return 0;
+  }
 
-    /* concat ending part */
-    char *es;
+  /* key: directory, words and variables, apart by unit separators */
+  char **kv = NULL;
+  int nk = 0, maxk = 0;
+  char *cwd = getcwd(NULL, 0);
 
-    if (end)
-      es = sv_unfold((char *[]){val, end + 1, NULL}, NULL, NULL, NULL);
-    else
-      es = strclo(val);
+  kv = sv_push(kv, &nk, &maxk, cwd ?: strclo(""));
+  kv = sv_push(kv, &nk, &maxk, sv_unfold(&argv[i], "\x1f", NULL, NULL));
 
-    free(val);
-    /* replace string */
-    free(v[i]);
-    v[i] = es;
+  for (int k = 0; k < nv; k++) {
+    char *v = getenv(vars[k]);
+    char *e = malloc(strlen(vars[k]) + (v ? strlen(v) : 0) + 3);
+
+    sprintf(e, "%s%s%s", vars[k], v ? "=" : "", v ?: "");
+    kv = sv_push(kv, &nk, &maxk, e);
   }
 
-  char *js;
-out:
-  js = sv_unfold(v, NULL, NULL, NULL); /* join substrings */
-  sv_free(v);
-  return js;
-}
+  char *key = sv_unfold(kv, "\x1e", NULL, NULL);
+  double now = pish_now();
+  struct pish_cache_ent *c = ht_get(&pish_cache_tab, key);
+  int status = 0;
 
-extern char **environ;
+  sv_free(kv);
+  free(vars);
 
-int pish_set(char **argv, int fds[2]) {
-  close(fds[0]);
+  if (c && c->expire > now) {
+    pish_xwrite(fds[1], c->out, c->len);
+    free(key);
+    return 0;
+  }
 
-  if (argv[1] != NULL) {
-    if (argv[2] != NULL)
-      setenv(argv[1], argv[2], 1);
-    else
-      setenv(argv[1], "", 1);
-  } else { // print environ
-    char **p = environ;
+  /* a miss, run it and keep what it prints */
+  int pfd[2];
+  struct pish_drain out = {0};
+  pthread_t tid;
+  pid_t pid;
 
-    while (*p != NULL)
-      dprintf(fds[1], "%s\n", *p++);
-  }
+  pipe2(pfd, O_CLOEXEC);
+  out.fd = pfd[0];
+  pthread_create(&tid, NULL, pish_drain, &out);
+  status = pish_exec(&argv[i], (int[2]){fds[0], pfd[1]}, &pid);
 
-  return 0;
+  if (pid)
+    status = pish_wait(pid);
+
+  close(pfd[1]);
+  pthread_join(tid, NULL);
+  close(pfd[0]);
+  pish_xwrite(fds[1], out.buf, out.len);
+
+  if (status == 0) {
+    if (pish_cache_tab.cnt >= PISH_CACHE_MAX)
+      pish_cache_sweep(now);
+
+    if (pish_cache_tab.cnt >= PISH_CACHE_MAX)
+      pish_cache_sweep(0);
+
+    c = calloc(1, sizeof(struct pish_cache_ent));
+    c->expire = now + ttl;
+    c->out = out.buf;
+    c->len = out.len;
+
+    /* the command may have replaced it, or swept it, meanwhile */
+    if ((c = ht_put(&pish_cache_tab, key, c))) {
+      free(c->out);
+      free(c);
+    }
+  } else
+    free(out.buf);
+
+  free(key);
+  return status;
 }
 
-int pish_unset(char **argv, int fds[2]) {
-  close(fds[0]);
+int pish_source(char **argv, int fds[2]) {
+  int i = 1;
+  int status = 0;
+
+  for (; argv[i]; i++) {
+    int fd = open(argv[i], O_RDONLY | O_CLOEXEC);
 
-  if (argv[1] != NULL)
-    unsetenv(argv[1]); // replace
+    if (fd >= 0) {
+      status = pish_repl(fd, fds);
 
-  return 0;
+      close(fd);
+      if (status < 0)
+        break;
+    } else {
+      fprintf(stderr, "failed to open file %s, errno = %d.\n", argv[i], errno);
+      return errno;
+    }
+  }
+
+  return status;
 }
 
+/*
+ * history of interactive shells, shared by all of them through HISTFILE,
+ * an append-only log of entries each ended by NUL. an entry is appended
+ * by a single write with O_APPEND, so concurrent shells never mix them.
+ * a trigram index of the log is kept in HISTFILE.idx and mapped, so a
+ * search neither reads the whole log nor parses it at startup. it is
+ * rebuilt into a new file renamed over the old one once the log has grown
+ * far enough beyond it, entries after it are scanned.
+ * the index maps a bucket of trigrams to blocks of entries having one,
+ * as deltas of block numbers in LEB128, which keeps it smaller than log.
+ */
+#define PISH_HIST_MAGIC "PISHHI2"
+#define PISH_HIST_TRI (1 << 20)     /* buckets of trigrams */
+#define PISH_HIST_BLOCK 64          /* entries in a block */
+#define PISH_HIST_REINDEX (1 << 20) /* bytes of log left unindexed at most */
+#define PISH_HIST_LOAD 1000         /* last entries loaded into readline */
+
 /**
- * fork a child process to execute @argv,
- * redirect its stdin to @fds[0] and stdout to @fds[1]
+ * index file: head, then offsets of blocks blk[nblk], buckets in use
+ * tri[ntri], where postings of tri[i] are data[at[i], at[i + 1]) of
+ * at[ntri + 1], and data.
  */
-int pish_fork(char **argv, int fds[2]) {
-  int pid = vfork();
+struct pish_hidx_head {
+  char magic[8];
+  uint64_t size; /* bytes of log indexed */
+  uint64_t nblk;
+  uint64_t ntri;
+};
 
-  if (pid == 0) {
-    dup2(fds[0], fileno(stdin));
-    dup2(fds[1], fileno(stdout));
+struct pish_hist {
+  bool open;
+  int fd;
+  char *path;
+  const char *log; /* mapped log */
+  size_t len;
+  const char *idx; /* mapped index, or NULL */
+  size_t idxlen;
+  const struct pish_hidx_head *head;
+  const uint64_t *blk;
+  const uint32_t *tri;
+  const uint64_t *at;
+  const uint8_t *data;
+};
 
-    int status = execvp(argv[0], argv);
+static struct pish_hist pish_hist;
 
-    fprintf(stderr, "failed to execute %s, ret = %d\n", argv[0], status);
-    exit(status);
+/** bucket of trigram @s, different ones sharing it are told by strstr */
+static uint32_t pish_hist_tri(const char *s) {
+  const unsigned char *u = (const unsigned char *)s;
+
+  return ((uint32_t)(u[0] << 16 | u[1] << 8 | u[2]) * 0x9e3779b1u) >> 12;
+}
+
+static void pish_hist_unindex(struct pish_hist *h) {
+  if (h->idx)
+    munmap((void *)h->idx, h->idxlen);
+
+  h->idx = NULL;
+  h->head = NULL;
+}
+
+/** map index of @h, a broken or stale one is ignored */
+static void pish_hist_index(struct pish_hist *h) {
+  char *path = sv_unfold(STRV(h->path, ".idx"), NULL, NULL, NULL);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+
+  free(path);
+  pish_hist_unindex(h);
+
+  if (fd < 0)
+    return;
+
+  if (fstat(fd, &st) == 0 &&
+      (size_t)st.st_size >= sizeof(struct pish_hidx_head)) {
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (p != MAP_FAILED) {
+      h->idx = p;
+      h->idxlen = st.st_size;
+    }
   }
 
-  return pid;
+  close(fd);
+
+  if (!h->idx)
+    return;
+
+  const struct pish_hidx_head *hd = (const void *)h->idx;
+  size_t n = h->idxlen / sizeof(uint32_t); /* bound of any count */
+
+  if (memcmp(hd->magic, PISH_HIST_MAGIC, 8) != 0 || hd->size > h->len ||
+      hd->nblk > n || hd->ntri > n) {
+    pish_hist_unindex(h);
+    return;
+  }
+
+  h->head = hd;
+  h->blk = (const uint64_t *)(hd + 1);
+  h->at = h->blk + hd->nblk;
+  h->tri = (const uint32_t *)(h->at + hd->ntri + 1);
+  h->data = (const uint8_t *)(h->tri + hd->ntri);
+  n = (const char *)h->data - h->idx;
+
+  if (n > h->idxlen || h->at[hd->ntri] > h->idxlen - n)
+    pish_hist_unindex(h);
 }
 
-/**
- * execute @cmd, if it is started with a builtin cmd,
- * run it directly, otherwise execute it with pish_fork()
- */
-int pish_exec(const char *cmd, int fds[2]) {
-  size_t j;
-  int status = 0;
-  char **argv = pish_fold(cmd, " \t\v\n;", false);
+/** map what is in the log by now, written by any shell */
+static bool pish_hist_map(struct pish_hist *h) {
+  struct stat st;
 
-  if (!argv || !argv[0])
-    return 0;
+  if (fstat(h->fd, &st) < 0)
+    return false;
 
-  for (j = 0; j < ARRAY_SIZE(pish_builtin_cmd); j++) {
-    if (strcmp(argv[0], pish_builtin_cmd[j].cmdstr) == 0)
-      break;
+  if ((size_t)st.st_size == h->len)
+    return true;
+
+  if (h->log)
+    munmap((void *)h->log, h->len);
+
+  h->log = NULL;
+  h->len = 0;
+
+  if (st.st_size > 0) {
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, h->fd, 0);
+
+    if (p == MAP_FAILED)
+      return false;
+
+    h->log = p;
+    h->len = st.st_size;
   }
 
-  if (j < ARRAY_SIZE(pish_builtin_cmd))
-    status = pish_builtin_cmd[j].exec(argv, fds);
-  else
-    status = pish_fork(argv, fds);
+  if (h->head && h->head->size > h->len) /* the log is cut */
+    pish_hist_unindex(h);
 
-  sv_free(argv);
-  return status;
+  return true;
 }
 
-/** expand strings in @argv once more */
-int pish_eval(char **argv, int fds[2]) {
-  if (!argv[0]) {
-    close(fds[0]);
-    return -1;
+/** open history, return NULL if it is not available */
+static struct pish_hist *pish_hist_get(void) {
+  struct pish_hist *h = &pish_hist;
+
+  if (!h->open) {
+    char *home = getenv("HOME");
+
+    h->open = true;
+    h->fd = -1;
+
+    if (getenv("HISTFILE"))
+      h->path = strclo(getenv("HISTFILE"));
+    else if (home)
+      h->path = sv_unfold(STRV(home, "/.pish_history"), NULL, NULL, NULL);
+    else
+      return NULL;
+
+    h->fd = open(h->path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+
+    if (h->fd >= 0 && pish_hist_map(h))
+      pish_hist_index(h);
   }
 
-  char *cmd = sv_unfold(&argv[1], "\" \"", "\"", "\"");
-  char *ecmd = pish_expand(cmd);
+  if (h->fd < 0 || !pish_hist_map(h))
+    return NULL;
 
-  free(cmd);
+  return h;
+}
 
-  int status = pish_exec(ecmd, fds);
+/** end of complete entries in log, a partly written one is left out */
+static size_t pish_hist_end(struct pish_hist *h) {
+  const char *p = h->len ? memrchr(h->log, '\0', h->len) : NULL;
 
-  free(ecmd);
-  return status;
+  return p ? (size_t)(p + 1 - h->log) : 0;
 }
 
-/** send @signum to all child processes */
-void pish_sweep(int signum) {
-  pid_t mypid = getpid();
-  pid_t pid;
+/** start of the entry ending at @end, which is after its NUL */
+static size_t pish_hist_prev(struct pish_hist *h, size_t end) {
+  const char *p = end > 1 ? memrchr(h->log, '\0', end - 1) : NULL;
 
-  while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
-    if (pid != mypid) {
-      kill(pid, signum);
-    }
-  }
+  return p ? (size_t)(p + 1 - h->log) : 0;
+}
+
+/** append @line to history, a blank one is not kept */
+static void pish_hist_add(const char *line) {
+  struct pish_hist *h;
+
+  if (!line[strspn(line, " \t\n")] || !(h = pish_hist_get()))
+    return;
+
+  if (write(h->fd, line, strlen(line) + 1) < 0)
+    perror("pish: history");
 }
 
 /**
- * execute command strings in @argv as subprocesses
- * and piping their I/O to the next one by one.
- * use stdin as input and print result to stdout.
- *
- * READ END fds[0] -+   pipev[0] --+    X
- *                  |      ||      |
- *                 cmd0    ||     cmd1
- *                  |      ||      |
- * WRITE END   X    +-> pipev[1]   +-> fds[1]
+ * rebuild the index of all of log, in two passes over the entries
+ * counting, then placing, the blocks having each bucket of trigrams.
  */
-int pish_pipe(char **argv, int fds[2]) {
-  int status = 0;
-  int n = sv_len(argv);
-  int(*pipev)[2] = malloc((1 + n) * sizeof(int[2]));
+static int pish_hist_reindex(struct pish_hist *h) {
+  size_t end = pish_hist_end(h);
+  uint64_t *blk = NULL;
+  uint64_t nblk = 0;
+  int max = 0;
+
+  for (size_t p = 0, i = 0; p < end; p += strlen(h->log + p) + 1, i++) {
+    if (i % PISH_HIST_BLOCK)
+      continue;
+
+    if (nblk + 1 >= (uint64_t)max)
+      blk = realloc(blk, (max = max ? max * 2 : 1024) * sizeof(uint64_t));
 
-  /* build pipes */
-  pipev[0][0] = dup(fds[0]);
+    blk[nblk++] = p;
+  }
 
-  for (int i = 1; i < n; i++)
-    pipe(pipev[i]);
+  uint32_t *seen = calloc(PISH_HIST_TRI, sizeof(uint32_t)); /* block + 1 */
+  uint64_t *at = calloc(PISH_HIST_TRI + 1, sizeof(uint64_t));
+  uint32_t *post = NULL;
+  uint64_t npost = 0;
 
-  pipev[n][1] = dup(fds[1]);
+  for (int pass = 0; pass < 2; pass++) {
+    memset(seen, 0, PISH_HIST_TRI * sizeof(uint32_t));
 
-  for (int i = 0; i < n; ++i) {
-    status = pish_exec(argv[i], (int[2]){pipev[i][0], pipev[i + 1][1]});
+    for (uint64_t b = 0; b < nblk; b++) {
+      const char *s = h->log + blk[b];
+      const char *e = h->log + (b + 1 < nblk ? blk[b + 1] : end);
 
-    if (status < 0) /* fork failure */
-      goto out;
+      for (; s + 2 < e; s++) {
+        if (!s[0] || !s[1] || !s[2])
+          continue;
 
-    /* close the write end here so that the next child won't get blocked. */
-    close(pipev[i + 1][1]);
-  }
+        uint32_t t = pish_hist_tri(s);
 
-  pid_t mypid = getpid();
-  pid_t pid;
+        if (seen[t] == b + 1)
+          continue;
 
-  status = 0;
-  /* wait for children */
-  while ((pid = waitpid(-1, &status, WUNTRACED)) >= 0) {
-    if (pid != mypid && WIFEXITED(status)) {
-      if ((status = WEXITSTATUS(status)) < 0)
-        goto out; /* an error is caught */
+        seen[t] = b + 1;
+
+        if (pass == 0)
+          at[t]++;
+        else
+          post[at[t]++] = b;
+      }
     }
+
+    if (pass == 1)
+      break;
+
+    for (uint32_t t = 0; t < PISH_HIST_TRI; t++) { /* counts into starts */
+      uint64_t n = at[t];
+
+      at[t] = npost;
+      npost += n;
+    }
+
+    post = malloc((npost ?: 1) * sizeof(uint32_t));
   }
 
-out:
-  pish_sweep(SIGKILL); /* kill all remaining children */
-  close(pipev[0][0]);
+  /* at[t] is the end of bucket t by now, encode them into data */
+  uint32_t *tri = malloc(PISH_HIST_TRI * sizeof(uint32_t));
+  uint64_t *pos = malloc((PISH_HIST_TRI + 1) * sizeof(uint64_t));
+  uint8_t *data = malloc(npost * 5 + 1);
+  uint64_t ntri = 0, len = 0;
+
+  for (uint32_t t = 0, i = 0; t < PISH_HIST_TRI; i = at[t++]) {
+    if (i == at[t])
+      continue;
+
+    tri[ntri] = t;
+    pos[ntri++] = len;
 
-  for (int i = 1; i < n; ++i) {
-    close(pipev[i][0]);
-    close(pipev[i][1]);
+    for (uint32_t last = 0; i < at[t]; last = post[i++])
+      for (uint32_t d = post[i] - last; ; d >>= 7) {
+        data[len++] = (d & 0x7f) | (d >= 0x80 ? 0x80 : 0);
+
+        if (d < 0x80)
+          break;
+      }
   }
 
-  close(pipev[n][1]);
-  fflush(stdout);
-  free(pipev);
+  pos[ntri] = len;
+
+  struct pish_hidx_head hd = {PISH_HIST_MAGIC, end, nblk, ntri};
+  char *path = sv_unfold(STRV(h->path, ".idx"), NULL, NULL, NULL);
+  char *tmp = sv_unfold(STRV(path, ".XXXXXX"), NULL, NULL, NULL);
+  int fd = mkstemp(tmp);
+  int status = 0;
+
+  if (fd < 0 || pish_xwrite(fd, &hd, sizeof(hd)) < 0 ||
+      pish_xwrite(fd, blk, nblk * sizeof(uint64_t)) < 0 ||
+      pish_xwrite(fd, pos, (ntri + 1) * sizeof(uint64_t)) < 0 ||
+      pish_xwrite(fd, tri, ntri * sizeof(uint32_t)) < 0 ||
+      pish_xwrite(fd, data, len) < 0 ||
+      rename(tmp, path) < 0) { /* a shell sees either the old or new one */
+    status = errno;
+    fprintf(stderr, "history: failed to write %s, errno = %d.\n", path,
+            errno);
+    unlink(tmp);
+  }
+
+  if (fd >= 0)
+    close(fd);
+
+  free(tmp);
+  free(path);
+  free(blk);
+  free(seen);
+  free(at);
+  free(post);
+  free(tri);
+  free(pos);
+  free(data);
+
+  if (!status)
+    pish_hist_index(h);
+
   return status;
 }
 
-/** entry */
-int pish(const char *cmdline, int fds[2]) {
-  char *cmd;
-  const char *end = strchr(cmdline, '#'); // comments
+/** compare buckets of trigrams, for bsearch() */
+static int pish_hist_tricmp(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
 
-  if (end)
-    cmd = strsub(cmdline, end - cmdline);
-  else
-    cmd = strclo(cmdline);
+  return (x > y) - (x < y);
+}
+
+/** decode blocks in postings of bucket @i into @v, return their number */
+static size_t pish_hist_blocks(struct pish_hist *h, size_t i, uint32_t *v) {
+  const uint8_t *p = h->data + h->at[i];
+  const uint8_t *end = h->data + h->at[i + 1];
+  uint32_t b = 0;
+  size_t n = 0;
 
-  char *ecmd = pish_expand(cmd);
+  while (p < end) {
+    uint32_t d = 0;
 
-  free(cmd);
+    for (int k = 0; p < end; k += 7) {
+      d |= (uint32_t)(*p & 0x7f) << k;
 
-  if (!ecmd)
-    return 0;
+      if (!(*p++ & 0x80))
+        break;
+    }
 
-  /*
-   * without a one-pass parser, we suffer and suck here
-   * however, the parse itself takes at least 500 lines.
-   */
-  char **cmdv = pish_fold(ecmd, "|", true);
+    v[n++] = b += d;
+  }
 
-  free(ecmd);
+  return n;
+}
 
-  int status = pish_pipe(cmdv, fds);
-  sprintf(pish_status, "%5d", status);
+/** print entry of log at @off to @o */
+static void pish_hist_put(struct pish_hist *h, struct pish_obuf *o,
+                          size_t off) {
+  const char *s = h->log + off;
 
-  sv_free(cmdv);
-  return status;
+  pish_oput(o, s, strlen(s));
+  pish_oput(o, "\n", 1);
 }
 
-/** update the environment variables for repl */
-void pish_update_env(void) {
-  char *dirname = get_current_dir_name();
+/** print entries in [@from, @end) containing @pat, newest first */
+static long pish_hist_scan(struct pish_hist *h, struct pish_obuf *o,
+                           const char *pat, size_t from, size_t end,
+                           long max) {
+  long hits = 0;
 
-  setenv("PWD", dirname, 1);
+  while (end > from && hits != max) {
+    size_t p = pish_hist_prev(h, end);
 
-  struct passwd *pw = getpwuid(getuid());
-  if (pw)
-    setenv("USER", pw->pw_name, 1);
-  else
-    setenv("USER", "", 1);
+    if (strstr(h->log + p, pat) && ++hits)
+      pish_hist_put(h, o, p);
 
-  free(dirname);
+    end = p;
+  }
+
+  return hits;
 }
 
 /**
- * read, evaluate, print line by line, @f is the input stream.
- * we use a FILE * pointer for bufferred IO.
+ * print at most @max entries containing @pat, newest first.
+ * entries after the index are scanned, the others are looked up in
+ * the blocks having the bucket of a trigram of @pat with fewest data.
  */
-int pish_repl(FILE *f, int fds[2]) {
-  int status = 0;
-  size_t bufsz = 0;
-  char *buf = NULL;
+static long pish_hist_search(struct pish_hist *h, struct pish_obuf *o,
+                             const char *pat, long max) {
+  size_t end = pish_hist_end(h);
+  size_t from = h->head ? h->head->size : 0;
+  long hits = pish_hist_scan(h, o, pat, from, end, max);
 
-  while (!feof(f)) {
-    pish_update_env();
+  if (!h->head || strlen(pat) < 3) /* too short to look up */
+    return hits + pish_hist_scan(h, o, pat, 0, from, max - hits);
 
-    if (getline(&buf, &bufsz, f) < 0)
-      break;
+  const uint32_t *best = NULL;
 
-    if (bufsz > 0) {
-      status = pish(buf, fds);
+  for (const char *s = pat; s[1] && s[2]; s++) {
+    uint32_t t = pish_hist_tri(s);
+    const uint32_t *e = bsearch(&t, h->tri, h->head->ntri, sizeof(uint32_t),
+                                pish_hist_tricmp);
 
-      if (status)
-        break;
-    }
+    if (!e) /* no entry has it */
+      return hits;
+
+    if (!best ||
+        h->at[e - h->tri + 1] - h->at[e - h->tri] <
+            h->at[best - h->tri + 1] - h->at[best - h->tri])
+      best = e;
   }
 
-  free(buf);
-  return status;
+  size_t i = best - h->tri;
+  uint32_t *v = malloc((h->at[i + 1] - h->at[i]) * sizeof(uint32_t));
+
+  for (size_t n = pish_hist_blocks(h, i, v); n > 0 && hits != max; n--) {
+    uint32_t b = v[n - 1];
+    size_t e = b + 1 < h->head->nblk ? h->blk[b + 1] : h->head->size;
+
+    hits += pish_hist_scan(h, o, pat, h->blk[b], e, max - hits);
+  }
+
+  free(v);
+  return hits;
 }
 
-/**
- * run pish() with bufferred input and output
- * do not forget to free the output buffer.
- */
-char *pish_fifo(const char *cmdline, const char *input) {
-  int fds[2][2];
+/** start of last @n entries before @end */
+static size_t pish_hist_last(struct pish_hist *h, size_t end, long n) {
+  while (end > 0 && n-- > 0)
+    end = pish_hist_prev(h, end);
 
-  pipe(fds[0]);
-  pipe(fds[1]);
+  return end;
+}
 
-  if (input) /* write input into write end */
-    write(fds[0][1], input, strlen(input));
+/** load last entries of history into readline, oldest first */
+static void pish_hist_load(void) {
+  struct pish_hist *h = pish_hist_get();
 
-  close(fds[0][1]);
-  int status = pish(cmdline, (int[2]){fds[0][0], fds[1][1]});
-  close(fds[0][0]);
-  close(fds[1][1]);
+  if (!h)
+    return;
 
-  if (status)
-    return NULL;
+  size_t end = pish_hist_end(h);
 
-  char *buf = NULL;
-  int size;
+  for (size_t p = pish_hist_last(h, end, PISH_HIST_LOAD); p < end;
+       p += strlen(h->log + p) + 1)
+    add_history(h->log + p);
+}
 
-  ioctl(fds[1][0], FIONREAD, &size); /* get size to read */
+/** rebuild index when shell leaves, if log has grown far beyond it */
+static void pish_hist_close(void) {
+  struct pish_hist *h = &pish_hist;
 
-  if (size > 0) {
-    buf = malloc((size + 1) * sizeof(char));
-    buf[size] = '\0'; /* append terminal */
+  if (h->open && h->fd >= 0 && pish_hist_map(h) &&
+      pish_hist_end(h) - (h->head ? h->head->size : 0) > PISH_HIST_REINDEX)
+    pish_hist_reindex(h);
+}
 
-    if ((size = read(fds[1][0], buf, size)) < 0) {
-      fprintf(stderr, "pipe read error, status = %d.\n", size);
-      free(buf);
-      buf = NULL;
+int pish_history(char **argv, int fds[2]) {
+  struct pish_hist *h = pish_hist_get();
+  const char *pat = NULL;
+  long max = -1;
+  int i = 1;
+
+  if (!h) {
+    fprintf(stderr, "history: failed to open %s, errno = %d.\n",
+            pish_hist.path ?: "$HOME/.pish_history", errno);
+    return 1;
+  }
+
+  if (argv[i] && strcmp(argv[i], "-r") == 0)
+    return pish_hist_reindex(h);
+
+  if (argv[i] && strcmp(argv[i], "-s") == 0) {
+    if (!(pat = argv[++i])) {
+      fprintf(stderr, "history: -s needs a pattern\n");
+      return 2;
     }
+
+    i++;
   }
 
-  close(fds[1][0]);
-  return buf;
-}
+  if (argv[i]) {
+    char *e;
 
-int pish_source(char **argv, int fds[2]) {
-  int i = 1;
+    max = strtol(argv[i], &e, 10);
+
+    if (*e || max < 0) {
+      fprintf(stderr, "history: bad number %s\n", argv[i]);
+      return 2;
+    }
+  }
+
+  struct pish_obuf *o = malloc(sizeof(struct pish_obuf));
   int status = 0;
 
-  while (argv[i]) {
-    FILE *f = fopen(argv[i], "r");
+  o->fd = fds[1];
+  o->len = 0;
 
-    if (f) {
-      status = pish_repl(f, fds);
+  if (pat)
+    status = !pish_hist_search(h, o, pat, max);
+  else {
+    size_t end = pish_hist_end(h);
 
-      fclose(f);
-      if (status < 0)
-        break;
-    } else {
-      fprintf(stderr, "failed to open file %s, errno = %d.\n", argv[i], errno);
-      return errno;
-    }
+    for (size_t p = max < 0 ? 0 : pish_hist_last(h, end, max); p < end;
+         p += strlen(h->log + p) + 1)
+      pish_hist_put(h, o, p);
   }
 
+  pish_oflush(o);
+  free(o);
   return status;
 }
 
@@ -954,6 +7453,8 @@ int pish_ishell(void) {
 
   setenv("PROMPT", "\e[0m[\e[33m${PWD}\e[0m]\e[31m,`'\e[0m ", 0);
   rl_bind_key('\t', rl_complete);
+  pish_hist_load();
+  atexit(pish_hist_close); /* by exit as well */
 
   while (true) {
     /* update env */
@@ -967,11 +7468,29 @@ int pish_ishell(void) {
     prompt = pish_expand(ps);
 
     char *line = readline(prompt);
+    struct pish_node *list = NULL;
+
+    /* read continuation lines until the command is complete */
+    while (line && pish_parse(line, &list) == PISH_EMORE) {
+      char *more = readline("> ");
+
+      if (!more) {
+        fprintf(stderr, "syntax error: unexpected end of input\n");
+        break;
+      }
+
+      char *s = sv_unfold(STRV(line, more), "\n", NULL, NULL);
+
+      free(line);
+      free(more);
+      line = s;
+    }
 
     if (line) {
       add_history(line);
+      pish_hist_add(line);
 
-      int status = pish(line, (int[2]){fileno(stdin), fileno(stdout)});
+      int status = pish_run_free(list, (int[2]){fileno(stdin), fileno(stdout)});
       free(line);
 
       if (status < 0)
@@ -997,6 +7516,9 @@ int main(int argc, char *argv[]) {
   pish_argc = argc;
   pish_argv = argv;
 
+  /* builtins see EPIPE instead of killing shell */
+  signal(SIGPIPE, SIG_IGN);
+
   if (argc > 1 && argv[1][0] == '-') {
     switch (argv[1][1]) {
     case 'c':
@@ -1015,7 +7537,7 @@ int main(int argc, char *argv[]) {
       return -1;
     };
   } else
-    return pish_repl(stdin, (int[2]){-1, fileno(stdout)});
+    return pish_repl(fileno(stdin), (int[2]){fileno(stdin), fileno(stdout)});
 
   return 0;
 }